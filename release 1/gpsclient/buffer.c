@@ -1,158 +1,1307 @@
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <arpa/inet.h>
 #include "sqlite3.h"
 #include "config.h"
 #include "database.h"
+#include "buffer.h"
+#include "seglog.h"
+#include "recpack.h"
+#include "hotq.h"
 #include "utils.h"
 
-static sqlite3 *bufdb;
+/* Records uploaded per buffer-interval when there is no backlog */
+#define BUFFER_DRAIN_ROWS 100
 
-static int buffer_delete(unsigned uid)
+/* Records waiting for the writer thread */
+#define BUFFER_QUEUE_SIZE 4096
+
+/* Records per compressed block */
+#define BUFFER_BLOCK_RECS 256
+
+/* Free pages handed back to the filesystem per drain cycle */
+#define BUFFER_VACUUM_PAGES 1024
+
+/* Wait for a lock held by the other connection */
+#define BUFFER_BUSY_MS 5000
+
+/* Hot queue fill, in percent of buffer-hot-rows, that starts spilling */
+#define BUFFER_HOT_HIGH 75
+
+/* Attempts at a failed group commit before its records are given up */
+#define BUFFER_COMMIT_TRIES 3
+#define BUFFER_COMMIT_RETRY_MS 100
+
+/* A connection to the buffer file with its prepared statements */
+struct buffer_conn {
+	sqlite3 *db;
+	sqlite3_stmt *insert;
+	sqlite3_stmt *select;
+	sqlite3_stmt *delete;
+	sqlite3_stmt *evict;
+	sqlite3_stmt *thin;
+	sqlite3_stmt *block_insert;
+	sqlite3_stmt *block_select;
+	sqlite3_stmt *block_tail;
+	sqlite3_stmt *block_update;
+	sqlite3_stmt *block_delete;
+	sqlite3_stmt *block_thin;
+};
+
+/*
+ * The writer thread commits on wconn, the drain thread reads and deletes
+ * on rconn. With WAL the drain reads run next to the writer's commits,
+ * buflock only orders the writes of the two. Every write to the buffer
+ * file, single records included, goes through one of these threads under
+ * buflock, producers only ever queue records.
+ */
+static struct buffer_conn wconn, rconn;
+static pthread_mutex_t buflock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct buffer_stats stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct db_record block_recs[BUFFER_BLOCK_RECS];
+static unsigned char block_buf[RECPACK_MAX(BUFFER_BLOCK_RECS)];
+static int backlog_rows;
+static int wal_pages;		/* not checkpointed, relaxed only, writer only */
+static int evicting;
+static unsigned evict_gen, read_gen;
+static struct db_record queue[BUFFER_QUEUE_SIZE];
+static unsigned queue_head, queue_count;
+static unsigned queue_pending;	/* queued or being committed */
+static int hot_spill;		/* hot tier uploads go through the disk */
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;	/* pops */
+static struct db_record hot_move[BUFFER_DRAIN_ROWS];
+static int commit_failed;	/* records were lost since the last commit */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_nonfull = PTHREAD_COND_INITIALIZER;
+
+/* Remove every row up to and including uid, in a single statement */
+static int buffer_delete(struct buffer_conn *c,
+			 sqlite3_stmt *stmt,
+			 sqlite3_int64 uid)
 {
-	char *cmd;
 	int ret;
 
-	cmd = sqlite3_mprintf("DELETE FROM buffer WHERE uid=%u", uid);
-	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
-	sqlite3_free(cmd);
-
-	if (ret != SQLITE_OK) {
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, uid);
+	ret = sqlite3_step(stmt);
+	if (ret != SQLITE_DONE) {
 		debug(DEBUG_ERROR, "could not delete buffer: %s",
-		      sqlite3_errmsg(bufdb));
+		      sqlite3_errmsg(c->db));
 		return 0;
 	}
 	return 1;
 }
 
-static void buffer_process(dbctx_t *dbctx)
+/* Value of the first column of a single row statement */
+static sqlite3_int64 buffer_query(struct buffer_conn *c,
+				  const char *cmd)
 {
-	int ret, row, col;
-	int i, j;
-	unsigned uid;
-	char **table;
-	struct db_data dbdata;
+	sqlite3_stmt *stmt;
+	sqlite3_int64 value = 0;
 
-	ret = sqlite3_get_table(bufdb, "SELECT * FROM buffer LIMIT 100",
-				&table, &row, &col, NULL);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_WARNING, "could not get table: %s", sqlite3_errmsg(bufdb));
-		return;
+	if (sqlite3_prepare_v2(c->db, cmd, -1, &stmt, NULL) != SQLITE_OK)
+		return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		value = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return value;
+}
+
+/*
+ * Records in the SQLite buffer, counted from scratch. Otherwise
+ * backlog_rows keeps track as records come and go.
+ */
+static int buffer_count(struct buffer_conn *c)
+{
+	if (config.buffer_compress)
+		return buffer_query(c, "SELECT total(count) FROM block");
+	return buffer_query(c, "SELECT count(*) FROM record");
+}
+
+static int buffer_backlog(void)
+{
+	int count;
+
+	if (config.buffer_backend == CONFIG_BUFFER_LOG)
+		return seglog_backlog();
+
+	pthread_mutex_lock(&buflock);
+	count = backlog_rows;
+	pthread_mutex_unlock(&buflock);
+	return count;
+}
+
+/*
+ * Disk space taken by buffered records, free pages not included. WAL
+ * pages not yet checkpointed count too.
+ */
+static long long buffer_bytes(struct buffer_conn *c)
+{
+	if (config.buffer_backend == CONFIG_BUFFER_LOG)
+		return seglog_bytes();
+
+	return (buffer_query(c, "PRAGMA page_count") - buffer_query(c, "PRAGMA freelist_count") +
+		wal_pages) * buffer_query(c, "PRAGMA page_size");
+}
+
+/*
+ * Read up to limit of the oldest records, in insertion order. last gets
+ * the uid of the last record read.
+ */
+static int record_read(struct buffer_conn *c,
+		       struct db_record *rec,
+		       int limit,
+		       sqlite3_int64 *last)
+{
+	int ret = SQLITE_DONE, row;
+
+	/* Typed reads, no text round trip of the REAL columns */
+	sqlite3_reset(c->select);
+	sqlite3_bind_int(c->select, 1, limit);
+	for (row = 0; row < limit; row++) {
+		ret = sqlite3_step(c->select);
+		if (ret != SQLITE_ROW)
+			break;
+		*last = sqlite3_column_int64(c->select, 0);
+		rec[row].sender_ip = htonl((uint32_t) sqlite3_column_int64(c->select, 1));
+		rec[row].gps_tsp = sqlite3_column_double(c->select, 2);
+		rec[row].recv_tsp = sqlite3_column_double(c->select, 3);
+		rec[row].gps_lat = sqlite3_column_double(c->select, 4);
+		rec[row].gps_lon = sqlite3_column_double(c->select, 5);
+		rec[row].packet_type = sqlite3_column_int(c->select, 6);
 	}
+	if (row < limit && ret != SQLITE_DONE)
+		debug(DEBUG_WARNING, "could not read buffer: %s", sqlite3_errmsg(c->db));
+	sqlite3_reset(c->select);
+	return row;
+}
 
-	sqlite3_exec(bufdb, "BEGIN", NULL, NULL, NULL);
+/* Remove the first done of the row records returned by record_read(c) */
+static int record_remove(struct buffer_conn *c,
+			 int done,
+			 int row,
+			 sqlite3_int64 last)
+{
+	/*
+	 * Rows are read in uid order and uids grow, so the accepted rows are
+	 * exactly those up to the last accepted uid. With a partial insert
+	 * upload the uids of the read rows may have gaps, locate the last
+	 * accepted one.
+	 */
+	if (done < row) {
+		sqlite3_reset(c->select);
+		sqlite3_bind_int(c->select, 1, done);
+		while (sqlite3_step(c->select) == SQLITE_ROW)
+			last = sqlite3_column_int64(c->select, 0);
+		sqlite3_reset(c->select);
+	}
+	return buffer_delete(c, c->delete, last);
+}
 
-	for (i = 0, j = col; i < row; i++, j += col) {
-		uid = atoi(table[j]);
-		snprintf(dbdata.client_name, sizeof(dbdata.client_name), "%s", table[j + 1]);
-		snprintf(dbdata.client_ip, sizeof(dbdata.client_ip), "%s", table[j + 2]);
-		snprintf(dbdata.sender_ip, sizeof(dbdata.sender_ip), "%s", table[j + 3]);
-		dbdata.gps_tsp = atof(table[j + 4]);
-		dbdata.gps_lat = atof(table[j + 5]);
-		dbdata.gps_lon = atof(table[j + 6]);
-		dbdata.packet_type = atoi(table[j + 7]);
+static int record_write(struct buffer_conn *c,
+			const struct db_record *rec,
+			int count)
+{
+	int i, ret;
 
-		ret = db_insert(dbctx, &dbdata);
-		if (!ret)
+	for (i = 0; i < count; i++) {
+		sqlite3_reset(c->insert);
+		sqlite3_bind_int64(c->insert, 1, ntohl(rec[i].sender_ip));
+		sqlite3_bind_double(c->insert, 2, rec[i].gps_tsp);
+		sqlite3_bind_double(c->insert, 3, rec[i].recv_tsp);
+		sqlite3_bind_double(c->insert, 4, rec[i].gps_lat);
+		sqlite3_bind_double(c->insert, 5, rec[i].gps_lon);
+		sqlite3_bind_int(c->insert, 6, rec[i].packet_type);
+		ret = sqlite3_step(c->insert);
+		if (ret != SQLITE_DONE) {
+			debug(DEBUG_ERROR, "could not insert buffer: %s", sqlite3_errmsg(c->db));
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Decode up to max records of the block in the current row of stmt */
+static int block_decode(sqlite3_stmt *stmt,
+			struct db_record *rec,
+			int max)
+{
+	const void *data = sqlite3_column_blob(stmt, 2);
+
+	return recpack_decode(data, sqlite3_column_bytes(stmt, 2), rec, max);
+}
+
+/* Store count records as block uid, or as a new block if uid is 0 */
+static int block_store(struct buffer_conn *c,
+		       sqlite3_int64 uid,
+		       const struct db_record *rec,
+		       int count)
+{
+	sqlite3_stmt *stmt = uid ? c->block_update : c->block_insert;
+	int len, ret;
+
+	len = recpack_encode(rec, count, block_buf);
+	sqlite3_reset(stmt);
+	sqlite3_bind_int(stmt, 1, count);
+	sqlite3_bind_blob(stmt, 2, block_buf, len, SQLITE_STATIC);
+	if (uid)
+		sqlite3_bind_int64(stmt, 3, uid);
+	ret = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	if (ret != SQLITE_DONE) {
+		debug(DEBUG_ERROR, "could not store buffer block: %s", sqlite3_errmsg(c->db));
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Append records to the compressed buffer. The last block is filled up
+ * to BUFFER_BLOCK_RECS first, records only ever go to the end of it, so
+ * a block being drained keeps the position of what was read. Filling the
+ * last block re-encodes all of it.
+ */
+static int block_write(struct buffer_conn *c,
+		       const struct db_record *rec,
+		       int count)
+{
+	sqlite3_int64 uid;
+	int n = 0, have, take;
+
+	sqlite3_reset(c->block_tail);
+	if (sqlite3_step(c->block_tail) == SQLITE_ROW) {
+		uid = sqlite3_column_int64(c->block_tail, 0);
+		have = block_decode(c->block_tail, block_recs, BUFFER_BLOCK_RECS);
+		sqlite3_reset(c->block_tail);
+		if (have > 0 && have < BUFFER_BLOCK_RECS) {
+			take = count < BUFFER_BLOCK_RECS - have ? count : BUFFER_BLOCK_RECS - have;
+			memcpy(&block_recs[have], rec, take * sizeof(struct db_record));
+			if (!block_store(c, uid, block_recs, have + take))
+				return 0;
+			n = take;
+		}
+	}
+	sqlite3_reset(c->block_tail);
+
+	while (n < count) {
+		take = count - n < BUFFER_BLOCK_RECS ? count - n : BUFFER_BLOCK_RECS;
+		if (!block_store(c, 0, &rec[n], take))
+			return 0;
+		n += take;
+	}
+	return 1;
+}
+
+/* Read up to limit of the oldest records from the compressed buffer */
+static int block_read(struct buffer_conn *c,
+		      struct db_record *rec,
+		      int limit)
+{
+	sqlite3_int64 uid, bad = 0;
+	int row = 0, n;
+
+	sqlite3_reset(c->block_select);
+	sqlite3_bind_int(c->block_select, 1, limit);
+	while (row < limit && sqlite3_step(c->block_select) == SQLITE_ROW) {
+		uid = sqlite3_column_int64(c->block_select, 0);
+		n = block_decode(c->block_select, &rec[row], limit - row);
+		if (n < 0) {
+			if (!row)
+				bad = uid;
 			break;
-		ret = buffer_delete(uid);
+		}
+		row += n;
+	}
+	sqlite3_reset(c->block_select);
+
+	/* A corrupt head block would stall the drain, give it up */
+	if (bad) {
+		debug(DEBUG_ERROR, "dropping corrupt buffer block uid=%lli", (long long) bad);
+		pthread_mutex_lock(&buflock);
+		buffer_delete(c, c->block_delete, bad);
+		backlog_rows = buffer_count(c);
+		pthread_mutex_unlock(&buflock);
+	}
+	return row;
+}
+
+/* Remove the done oldest records, keeping the rest of a partial block */
+static int block_remove(struct buffer_conn *c,
+			int done)
+{
+	sqlite3_int64 uid, last = 0;
+	int count, n, ret = 1;
+
+	sqlite3_reset(c->block_select);
+	sqlite3_bind_int(c->block_select, 1, done);
+	while (done && sqlite3_step(c->block_select) == SQLITE_ROW) {
+		uid = sqlite3_column_int64(c->block_select, 0);
+		count = sqlite3_column_int(c->block_select, 1);
+		if (count > done) {
+			n = block_decode(c->block_select, block_recs, BUFFER_BLOCK_RECS);
+			sqlite3_reset(c->block_select);
+			ret = n > done && block_store(c, uid, &block_recs[done], n - done);
+			break;
+		}
+		last = uid;
+		done -= count;
+	}
+	sqlite3_reset(c->block_select);
+
+	if (ret && last)
+		ret = buffer_delete(c, c->block_delete, last);
+	return ret;
+}
+
+static int buffer_read(struct db_record *rec,
+		       int limit,
+		       sqlite3_int64 *last)
+{
+	pthread_mutex_lock(&buflock);
+	read_gen = evict_gen;
+	pthread_mutex_unlock(&buflock);
+
+	if (config.buffer_backend == CONFIG_BUFFER_LOG)
+		return seglog_read(rec, limit);
+	else if (config.buffer_compress)
+		return block_read(&rconn, rec, limit);
+	return record_read(&rconn, rec, limit, last);
+}
+
+/* Remove the first done of the row records returned by buffer_read() */
+static int buffer_remove(int done,
+			 int row,
+			 sqlite3_int64 last)
+{
+	struct buffer_conn *c = &rconn;
+	int ret;
+
+	pthread_mutex_lock(&buflock);
+
+	/*
+	 * Records evicted since the read shifted the head, nothing is removed
+	 * and the uploaded records are sent again. Not even a complete row
+	 * batch is safe to remove by uid: uids are not AUTOINCREMENT, once
+	 * eviction took the newest rows new ones may reuse uids up to last.
+	 */
+	if (read_gen != evict_gen) {
+		debug(DEBUG_WARNING, "buffer evicted during upload, %i records will be resent", done);
+		pthread_mutex_unlock(&buflock);
+		return 0;
+	}
+
+	if (config.buffer_backend == CONFIG_BUFFER_LOG) {
+		ret = seglog_consume(done);
+	} else if (config.buffer_compress) {
+		ret = sqlite3_exec(c->db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK;
 		if (!ret)
+			debug(DEBUG_ERROR, "could not begin buffer remove: %s", sqlite3_errmsg(c->db));
+		if (ret)
+			ret = block_remove(c, done);
+		if (ret && sqlite3_exec(c->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+			debug(DEBUG_ERROR, "could not commit buffer remove: %s", sqlite3_errmsg(c->db));
+			ret = 0;
+		}
+		if (ret)
+			backlog_rows -= done;
+		else if (!sqlite3_get_autocommit(c->db))
+			sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+	} else {
+		ret = record_remove(c, done, row, last);
+		if (ret)
+			backlog_rows -= sqlite3_changes(c->db);
+	}
+	pthread_mutex_unlock(&buflock);
+	return ret;
+}
+
+/* Drop the count oldest records */
+static int buffer_drop_oldest(struct buffer_conn *c,
+			      int count)
+{
+	int ret;
+
+	if (config.buffer_backend == CONFIG_BUFFER_LOG)
+		return seglog_consume(count) ? count : 0;
+	if (config.buffer_compress)
+		return block_remove(c, count) ? count : 0;
+
+	sqlite3_reset(c->evict);
+	sqlite3_bind_int(c->evict, 1, count);
+	ret = sqlite3_step(c->evict);
+	sqlite3_reset(c->evict);
+	return ret == SQLITE_DONE ? sqlite3_changes(c->db) : 0;
+}
+
+/*
+ * Drop up to count of the oldest records that were not thinned out yet,
+ * keeping 1 of buffer-downsample. Rows survive when their uid is a
+ * multiple of it. Blocks are thinned once each, a thinned block is left
+ * with at most BUFFER_BLOCK_RECS / buffer-downsample records. Returns
+ * the number dropped, less than count once everything is thinned.
+ */
+static int buffer_downsample(struct buffer_conn *c,
+			     int count)
+{
+	int n = config.buffer_downsample, dropped = 0, have, i;
+
+	if (!config.buffer_compress) {
+		sqlite3_reset(c->thin);
+		sqlite3_bind_int(c->thin, 1, n);
+		sqlite3_bind_int(c->thin, 2, count);
+		if (sqlite3_step(c->thin) == SQLITE_DONE)
+			dropped = sqlite3_changes(c->db);
+		sqlite3_reset(c->thin);
+		return dropped;
+	}
+
+	while (dropped < count) {
+		sqlite3_reset(c->block_thin);
+		sqlite3_bind_int(c->block_thin, 1, BUFFER_BLOCK_RECS / n);
+		if (sqlite3_step(c->block_thin) != SQLITE_ROW)
+			break;
+		have = block_decode(c->block_thin, block_recs, BUFFER_BLOCK_RECS);
+		if (have <= 0)
 			break;
+		for (i = 0; i * n < have; i++)
+			block_recs[i] = block_recs[i * n];
+		if (!block_store(c, sqlite3_column_int64(c->block_thin, 0), block_recs, i))
+			break;
+		dropped += have - i;
 	}
+	sqlite3_reset(c->block_thin);
+	return dropped;
+}
+
+/*
+ * Make room for count new records within buffer-max-rows and
+ * buffer-max-bytes, according to buffer-evict. Returns how many of the
+ * new records may be written, evicted gets the number of records dropped.
+ * Runs under buflock, the caller counts them once buflock is released.
+ */
+static int buffer_evict(struct buffer_conn *c,
+			int count,
+			int *evicted)
+{
+	long long bytes, over;
+	int backlog, excess = 0, n;
+
+	*evicted = 0;
+	if (!config.buffer_max_rows && !config.buffer_max_bytes)
+		return count;
 
-	sqlite3_exec(bufdb, "COMMIT", NULL, NULL, NULL);
+	backlog = config.buffer_backend == CONFIG_BUFFER_LOG ? seglog_backlog() : backlog_rows;
+	if (config.buffer_max_rows && backlog + count > config.buffer_max_rows)
+		excess = backlog + count - config.buffer_max_rows;
+	if (config.buffer_max_bytes && backlog) {
+		bytes = buffer_bytes(c);
+		if (bytes > config.buffer_max_bytes) {
+			/* Estimated from the average record size */
+			over = (bytes - config.buffer_max_bytes) * backlog / bytes + count;
+			if (over > excess)
+				excess = over < backlog + count ? over : backlog + count;
+		}
+	}
+
+	if (!excess) {
+		if (evicting)
+			debug(DEBUG_INFO, "buffer below limits, eviction stopped");
+		evicting = 0;
+		return count;
+	}
 
-	if (i)
-		debug(DEBUG_INFO, "processed %i records to db", i);
-	sqlite3_free_table(table);
+	if (config.buffer_evict == CONFIG_EVICT_NEWEST) {
+		n = excess < count ? excess : count;
+		count -= n;
+	} else {
+		n = 0;
+		if (config.buffer_evict == CONFIG_EVICT_DOWNSAMPLE &&
+		    config.buffer_backend != CONFIG_BUFFER_LOG)
+			n = buffer_downsample(c, excess);
+		if (n < excess)
+			n += buffer_drop_oldest(c, excess - n);
+		if (config.buffer_backend != CONFIG_BUFFER_LOG)
+			backlog_rows -= n;
+	}
+
+	if (!evicting)
+		debug(DEBUG_WARNING, "buffer full backlog=%i, evicting records", backlog);
+	evicting = 1;
+	if (config.buffer_evict != CONFIG_EVICT_NEWEST)
+		evict_gen++;
+	*evicted = n;
+	return count;
+}
+
+/*
+ * Give free pages back to the filesystem, a bounded amount at a time,
+ * and checkpoint for buffer-durability relaxed after the drain deletes.
+ */
+static void buffer_vacuum(void)
+{
+	struct buffer_conn *c = &rconn;
+	char cmd[64];
+
+	if (config.buffer_backend == CONFIG_BUFFER_LOG)
+		return;
+
+	snprintf(cmd, sizeof(cmd), "PRAGMA incremental_vacuum(%i)", BUFFER_VACUUM_PAGES);
+	pthread_mutex_lock(&buflock);
+	if (buffer_query(c, "PRAGMA freelist_count"))
+		sqlite3_exec(c->db, cmd, NULL, NULL, NULL);
+	pthread_mutex_unlock(&buflock);
+
+	if (config.buffer_durability == CONFIG_DURABILITY_RELAXED)
+		sqlite3_wal_checkpoint_v2(c->db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+}
+
+/* Upload count records, returns how many of the first ones went through */
+static int buffer_upload(dbctx_t *dbctx,
+			 const struct db_record *rec,
+			 struct db_data *dbdata,
+			 int count)
+{
+	int done;
+
+	for (done = 0; done < count; done++)
+		db_record_unpack(&rec[done], &dbdata[done]);
+
+	/* COPY and pipeline are all or nothing, INSERT keeps what went through */
+	if (config.db_upload == CONFIG_UPLOAD_COPY)
+		done = db_copy(dbctx, dbdata, count) ? count : 0;
+	else if (config.db_upload == CONFIG_UPLOAD_PIPELINE)
+		done = db_insert_batch(dbctx, dbdata, count) ? count : 0;
+	else
+		for (done = 0; done < count; done++)
+			if (!db_insert(dbctx, &dbdata[done]))
+				break;
+	return done;
+}
+
+/*
+ * Upload up to limit of the oldest records, rec and dbdata must hold
+ * limit entries. Returns the number of records uploaded and removed.
+ */
+static int buffer_process(dbctx_t *dbctx,
+			  struct db_record *rec,
+			  struct db_data *dbdata,
+			  int limit)
+{
+	int row, done;
+	sqlite3_int64 last = 0;
+
+	row = buffer_read(rec, limit, &last);
+	if (!row)
+		return 0;
+	done = buffer_upload(dbctx, rec, dbdata, row);
+	if (!done)
+		return 0;
+
+	/* Records are removed only after the database accepted them */
+	if (!buffer_remove(done, row, last))
+		return 0;
+
+	debug(DEBUG_INFO, "processed %i records to db", done);
+	return done;
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
+/*
+ * Keeps one database connection for the life of the process. A broken
+ * connection is reset, failed attempts back off exponentially from
+ * buffer-interval up to db-retry-max seconds.
+ *
+ * A full batch means a backlog: the next batch follows immediately with
+ * twice the size, up to buffer-drain-max, until a batch comes back short
+ * and the thread returns to buffer-interval.
+ */
 static void *buffer_routine(void *data)
 {
-	dbctx_t *ctx;
+	dbctx_t *ctx = NULL;
+	struct db_record *rec;
+	struct db_data *dbdata;
 	int sleepms = config.buffer_interval * 1000;
+	int backoff = sleepms;
+	int limit = BUFFER_DRAIN_ROWS;
+	int ok, done, backlog;
+	unsigned drained = 0;
+	double start = 0, elapsed;
+
+	rec = malloc(config.buffer_drain_max * sizeof(struct db_record));
+	dbdata = malloc(config.buffer_drain_max * sizeof(struct db_data));
+	if (!rec || !dbdata) {
+		debug(DEBUG_ERROR, "could not allocate drain batch");
+		_exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		if (!ctx)
+			ctx = db_connect();
+		ok = ctx && db_check(ctx);
+		if (ok) {
+			backoff = sleepms;
+			if (!drained)
+				start = now_seconds();
+			done = buffer_process(ctx, rec, dbdata, limit);
+			drained += done;
+
+			/* buflock is never taken under stats_lock */
+			backlog = buffer_backlog();
+			pthread_mutex_lock(&stats_lock);
+			stats.backlog = backlog;
+			elapsed = now_seconds() - start;
+			if (drained && elapsed > 0)
+				stats.drain_rate = drained / elapsed;
+			stats.batch = limit;
+			pthread_mutex_unlock(&stats_lock);
+
+			if (done == limit) {
+				/* Catch up mode */
+				if (limit < config.buffer_drain_max)
+					limit *= 2;
+				if (limit > config.buffer_drain_max)
+					limit = config.buffer_drain_max;
+				continue;
+			}
+
+			if (drained)
+				debug(DEBUG_INFO, "buffer drained rows=%u rate=%.1f/s backlog=%i",
+				      drained, stats.drain_rate, stats.backlog);
+			drained = 0;
+			limit = BUFFER_DRAIN_ROWS;
+
+			buffer_vacuum();
+			msleep(sleepms);
+		} else {
+			drained = 0;
+			limit = BUFFER_DRAIN_ROWS;
+			debug(DEBUG_WARNING, "database unreachable, retry in %i ms", backoff);
+			msleep(backoff);
+			backoff *= 2;
+			if (backoff > config.db_retry_max * 1000)
+				backoff = config.db_retry_max * 1000;
+		}
+	}
+
+	/* Not reached */
+	db_close(ctx);
+	return NULL;
+}
+
+/* Count records dropped by buffer-evict */
+static void buffer_evicted(int count)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats.evicted += count;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Count records that could not be stored */
+static void buffer_lost(int count)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats.lost += count;
+	pthread_mutex_unlock(&stats_lock);
+	__atomic_store_n(&commit_failed, 1, __ATOMIC_RELAXED);
+	debug(DEBUG_ERROR, "could not store %i records, dropped", count);
+}
+
+/*
+ * Commit a group of records in one transaction. Returns 0 if nothing was
+ * committed, the batch can then be tried again as a whole.
+ */
+static int buffer_commit(const struct db_record *db,
+			 int count)
+{
+	struct buffer_conn *c = &wconn;
+	int ret, evicted;
+
+	pthread_mutex_lock(&buflock);
+	if (config.buffer_backend == CONFIG_BUFFER_LOG) {
+		/* Appended records stay, only the rest is dropped */
+		count = buffer_evict(c, count, &evicted);
+		pthread_mutex_unlock(&buflock);
+		buffer_evicted(evicted);
+		ret = seglog_append(db, count);
+		if (ret < count)
+			buffer_lost(count - ret);
+		else
+			__atomic_store_n(&commit_failed, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	/* Without the transaction each row would commit on its own */
+	if (sqlite3_exec(c->db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not begin buffer commit: %s", sqlite3_errmsg(c->db));
+		pthread_mutex_unlock(&buflock);
+		return 0;
+	}
+	count = buffer_evict(c, count, &evicted);
+	if (config.buffer_compress)
+		ret = block_write(c, db, count);
+	else
+		ret = record_write(c, db, count);
+	if (ret && sqlite3_exec(c->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not commit buffer: %s", sqlite3_errmsg(c->db));
+		ret = 0;
+	}
+	if (ret) {
+		backlog_rows += count;
+		__atomic_store_n(&commit_failed, 0, __ATOMIC_RELAXED);
+	} else {
+		/* Evictions are rolled back with the rest */
+		sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+		backlog_rows = buffer_count(c);
+	}
+	pthread_mutex_unlock(&buflock);
+	if (ret)
+		buffer_evicted(evicted);
+	return ret;
+}
+
+/*
+ * buffer-durability relaxed has no automatic checkpoints. The writer runs
+ * a passive one every buffer-interval after its commits, so the WAL stays
+ * bounded while the database is unreachable too. Frames a reader kept it
+ * from copying back count against buffer-max-bytes.
+ */
+static void buffer_checkpoint(void)
+{
+	static double last;
+	struct buffer_conn *c = &wconn;
+	int log, done;
+	double now;
+
+	if (config.buffer_backend == CONFIG_BUFFER_LOG ||
+	    config.buffer_durability != CONFIG_DURABILITY_RELAXED)
+		return;
+
+	now = now_seconds();
+	if (now - last < config.buffer_interval)
+		return;
+	last = now;
+	if (sqlite3_wal_checkpoint_v2(c->db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+				      &log, &done) == SQLITE_OK)
+		wal_pages = log - done;
+}
+
+/*
+ * Group commit writer. Waits for the first queued record, then keeps
+ * collecting until buffer-commit-rows records are queued or
+ * buffer-commit-ms elapsed, and commits them together.
+ */
+static void *writer_routine(void *data)
+{
+	struct db_record *batch;
+	struct timespec deadline;
+	int i, n, ret, tries;
+
+	batch = malloc(config.buffer_commit_rows * sizeof(struct db_record));
+	if (!batch) {
+		debug(DEBUG_ERROR, "could not allocate buffer commit batch");
+		_exit(EXIT_FAILURE);
+	}
 
 	while (1) {
-		ctx = db_connect();
-		if (ctx) {
-			buffer_process(ctx);
-			db_close(ctx);
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_count)
+			pthread_cond_wait(&queue_nonempty, &queue_lock);
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += config.buffer_commit_ms / 1000;
+		deadline.tv_nsec += config.buffer_commit_ms % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		ret = 0;
+		while (queue_count < config.buffer_commit_rows && ret != ETIMEDOUT)
+			ret = pthread_cond_timedwait(&queue_nonempty, &queue_lock, &deadline);
+
+		n = queue_count;
+		if (n > config.buffer_commit_rows)
+			n = config.buffer_commit_rows;
+		for (i = 0; i < n; i++)
+			batch[i] = queue[(queue_head + i) % BUFFER_QUEUE_SIZE];
+		queue_head = (queue_head + n) % BUFFER_QUEUE_SIZE;
+		queue_count -= n;
+		pthread_cond_broadcast(&queue_nonfull);
+		pthread_mutex_unlock(&queue_lock);
+
+		for (tries = 1; !buffer_commit(batch, n); tries++) {
+			if (tries == BUFFER_COMMIT_TRIES) {
+				buffer_lost(n);
+				break;
+			}
+			msleep(BUFFER_COMMIT_RETRY_MS);
 		}
-		msleep(sleepms);
+		buffer_checkpoint();
+
+		pthread_mutex_lock(&queue_lock);
+		queue_pending -= n;
+		pthread_mutex_unlock(&queue_lock);
 	}
 	return NULL;
 }
 
+/*
+ * Queue records for the writer thread, they are committed within
+ * buffer-commit-ms. Blocks while the queue is full.
+ */
+static void buffer_queue(const struct db_record *db,
+			 int count)
+{
+	int i;
+
+	pthread_mutex_lock(&queue_lock);
+	for (i = 0; i < count; i++) {
+		while (queue_count == BUFFER_QUEUE_SIZE)
+			pthread_cond_wait(&queue_nonfull, &queue_lock);
+		queue[(queue_head + queue_count) % BUFFER_QUEUE_SIZE] = db[i];
+		queue_count++;
+		queue_pending++;
+	}
+	pthread_cond_signal(&queue_nonempty);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Nothing queued for, being committed to or waiting in the buffer */
+static int buffer_idle(void)
+{
+	unsigned pending;
+
+	pthread_mutex_lock(&queue_lock);
+	pending = queue_pending;
+	pthread_mutex_unlock(&queue_lock);
+	return !pending && !buffer_backlog();
+}
+
+/*
+ * Hot tier uploader, with buffer-hot-rows set. Records are popped from
+ * the hot queue and uploaded right away, on a connection of its own,
+ * while the on-disk buffer is empty.
+ *
+ * A failed upload, or the hot queue filling past BUFFER_HOT_HIGH percent
+ * or up, switches to spilling: popped records go to the writer thread and
+ * on to disk like without the hot tier, in the order they were popped.
+ * Direct uploads resume only once the writer queue and the on-disk buffer
+ * are empty, so a record is never uploaded ahead of one spilled before
+ * it. For the same reason a backlog left by the previous run starts the
+ * uploader spilling.
+ *
+ * Producers never wait for an upload, see hot_overflow(). Pops and the
+ * switch back to direct uploads are done under hot_lock for that.
+ *
+ * Records in the hot queue are lost on a crash, like those waiting for
+ * the writer thread. While the database keeps up that is at most what
+ * arrived in the last buffer-commit-ms plus one upload.
+ */
+static void *hot_routine(void *data)
+{
+	dbctx_t *ctx = NULL;
+	struct db_record *rec;
+	struct db_data *dbdata;
+	unsigned high = (unsigned) config.buffer_hot_rows * BUFFER_HOT_HIGH / 100;
+	int n, done, spill;
+
+	rec = malloc(config.buffer_hot_rows * sizeof(struct db_record));
+	dbdata = malloc(config.buffer_hot_rows * sizeof(struct db_data));
+	if (!rec || !dbdata) {
+		debug(DEBUG_ERROR, "could not allocate hot tier batch");
+		_exit(EXIT_FAILURE);
+	}
+
+	spill = !buffer_idle();
+	__atomic_store_n(&hot_spill, spill, __ATOMIC_RELAXED);
+	if (spill)
+		debug(DEBUG_INFO, "buffer backlog, hot tier spills to disk until drained");
+
+	while (1) {
+		pthread_mutex_lock(&hot_lock);
+		spill = __atomic_load_n(&hot_spill, __ATOMIC_RELAXED);
+		if (!spill && hotq_count() > high) {
+			debug(DEBUG_WARNING, "hot queue above high-water, spilling to disk");
+			spill = 1;
+		} else if (spill && buffer_idle()) {
+			debug(DEBUG_INFO, "buffer empty, hot tier uploads resumed");
+			spill = 0;
+		}
+		__atomic_store_n(&hot_spill, spill, __ATOMIC_RELAXED);
+		n = hotq_pop(rec, config.buffer_hot_rows);
+		pthread_mutex_unlock(&hot_lock);
+		if (!n) {
+			msleep(config.buffer_commit_ms);
+			continue;
+		}
+
+		done = 0;
+		if (!spill) {
+			if (!ctx)
+				ctx = db_connect();
+			if (ctx && db_check(ctx))
+				done = buffer_upload(ctx, rec, dbdata, n);
+			if (done < n) {
+				debug(DEBUG_WARNING, "hot tier upload failed, spilling to disk");
+				__atomic_store_n(&hot_spill, 1, __ATOMIC_RELAXED);
+			}
+		}
+		if (done < n)
+			buffer_queue(&rec[done], n - done);
+	}
+
+	/* Not reached */
+	db_close(ctx);
+	return NULL;
+}
+
+/* inet_aton() as an SQL function, for the text sender_ip of old files */
+static void sql_inet_aton(sqlite3_context *ctx,
+			  int argc,
+			  sqlite3_value **argv)
+{
+	const unsigned char *text = sqlite3_value_text(argv[0]);
+	struct in_addr addr;
+
+	if (text && inet_pton(AF_INET, (const char*) text, &addr) == 1)
+		sqlite3_result_int64(ctx, ntohl(addr.s_addr));
+	else
+		sqlite3_result_int64(ctx, 0);
+}
+
+/*
+ * Buffer files of older versions keep whole text rows in the buffer
+ * table. Move them to the record table in one transaction, ahead of
+ * anything new.
+ */
+static int buffer_migrate(struct buffer_conn *c)
+{
+	sqlite3_stmt *stmt;
+	const char *cmd;
+	int ret;
+
+	cmd = "SELECT 1 FROM sqlite_master WHERE type='table' AND name='buffer'";
+	if (sqlite3_prepare_v2(c->db, cmd, -1, &stmt, NULL) != SQLITE_OK)
+		return 0;
+	ret = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (ret != SQLITE_ROW)
+		return 1;
+
+	/* The oldest files lack recv_tsp, error if present */
+	sqlite3_exec(c->db, "ALTER TABLE buffer ADD COLUMN recv_tsp REAL", NULL, NULL, NULL);
+
+	sqlite3_create_function(c->db, "inet_aton", 1, SQLITE_UTF8, NULL,
+				&sql_inet_aton, NULL, NULL);
+	cmd = "BEGIN;"
+	      "INSERT INTO record(sender_ip,gps_tsp,recv_tsp,gps_lat,gps_lon,packet_type)"
+	      " SELECT inet_aton(sender_ip),gps_tsp,recv_tsp,gps_lat,gps_lon,packet_type"
+	      " FROM buffer ORDER BY uid;"
+	      "DROP TABLE buffer;"
+	      "COMMIT";
+	ret = sqlite3_exec(c->db, cmd, NULL, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not migrate buffer: %s", sqlite3_errmsg(c->db));
+		sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+		return 0;
+	}
+	debug(DEBUG_INFO, "buffer migrated to packed records");
+	return 1;
+}
+
+static int buffer_prepare(struct buffer_conn *c,
+			  const char *cmd,
+			  sqlite3_stmt **stmt)
+{
+	if (sqlite3_prepare_v2(c->db, cmd, -1, stmt, NULL) != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not prepare %s: %s", cmd, sqlite3_errmsg(c->db));
+		return 0;
+	}
+	return 1;
+}
+
+static int buffer_prepare_all(struct buffer_conn *c)
+{
+	return buffer_prepare(c, "INSERT INTO record(sender_ip,gps_tsp,recv_tsp,gps_lat,"
+			      "gps_lon,packet_type) VALUES(?,?,?,?,?,?)",
+			      &c->insert) &&
+	       buffer_prepare(c, "SELECT uid,sender_ip,gps_tsp,recv_tsp,gps_lat,gps_lon,"
+			      "packet_type FROM record ORDER BY uid LIMIT ?",
+			      &c->select) &&
+	       buffer_prepare(c, "DELETE FROM record WHERE uid <= ?",
+			      &c->delete) &&
+	       buffer_prepare(c, "DELETE FROM record WHERE uid IN "
+			      "(SELECT uid FROM record ORDER BY uid LIMIT ?)",
+			      &c->evict) &&
+	       buffer_prepare(c, "DELETE FROM record WHERE uid IN "
+			      "(SELECT uid FROM record WHERE uid % ?1 != 0 ORDER BY uid LIMIT ?2)",
+			      &c->thin) &&
+	       buffer_prepare(c, "INSERT INTO block(count,data) VALUES(?,?)",
+			      &c->block_insert) &&
+	       buffer_prepare(c, "SELECT uid,count,data FROM block ORDER BY uid LIMIT ?",
+			      &c->block_select) &&
+	       buffer_prepare(c, "SELECT uid,count,data FROM block ORDER BY uid DESC LIMIT 1",
+			      &c->block_tail) &&
+	       buffer_prepare(c, "UPDATE block SET count = ?, data = ? WHERE uid = ?",
+			      &c->block_update) &&
+	       buffer_prepare(c, "DELETE FROM block WHERE uid <= ?",
+			      &c->block_delete) &&
+	       buffer_prepare(c, "SELECT uid,count,data FROM block WHERE count > ? ORDER BY uid LIMIT 1",
+			      &c->block_thin);
+}
+
+/*
+ * Open a connection with the buffer-durability settings, which are per
+ * connection. In WAL mode synchronous FULL syncs every commit, NORMAL
+ * only at checkpoints and OFF never. relaxed leaves checkpoints to the
+ * writer and drain threads, once per buffer-interval.
+ */
+static int buffer_open(struct buffer_conn *c)
+{
+	static const char * const pragmas[] = {
+		[CONFIG_DURABILITY_STRICT] =
+			"PRAGMA synchronous = FULL; PRAGMA wal_autocheckpoint = 1000",
+		[CONFIG_DURABILITY_NORMAL] =
+			"PRAGMA synchronous = NORMAL; PRAGMA wal_autocheckpoint = 4000",
+		[CONFIG_DURABILITY_RELAXED] =
+			"PRAGMA synchronous = OFF; PRAGMA wal_autocheckpoint = 0",
+	};
+	int ret;
+
+	ret = sqlite3_open(config.buffer_file, &c->db);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not open buffer file: %s", sqlite3_errmsg(c->db));
+		sqlite3_close(c->db);
+		return 0;
+	}
+	sqlite3_busy_timeout(c->db, BUFFER_BUSY_MS);
+
+	ret = sqlite3_exec(c->db, pragmas[config.buffer_durability], NULL, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not set buffer option: %s", sqlite3_errmsg(c->db));
+		sqlite3_close(c->db);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Records left by a run with the other buffer-compress setting are moved
+ * to the table in use, oldest first, in one transaction.
+ */
+static int buffer_convert(struct buffer_conn *c)
+{
+	struct db_record rec[BUFFER_BLOCK_RECS];
+	sqlite3_int64 last = 0;
+	int n, moved = 0, ret = 1;
+
+	sqlite3_exec(c->db, "BEGIN", NULL, NULL, NULL);
+	while (ret) {
+		if (config.buffer_compress) {
+			n = record_read(c, rec, BUFFER_BLOCK_RECS, &last);
+			if (!n)
+				break;
+			ret = block_write(c, rec, n) && record_remove(c, n, n, last);
+		} else {
+			n = block_read(c, rec, BUFFER_BLOCK_RECS);
+			if (!n)
+				break;
+			ret = record_write(c, rec, n) && block_remove(c, n);
+		}
+		moved += n;
+	}
+	if (!ret || sqlite3_exec(c->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not convert buffer: %s", sqlite3_errmsg(c->db));
+		sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+		return 0;
+	}
+	if (moved)
+		debug(DEBUG_INFO, "buffer converted %i records to %s", moved,
+		      config.buffer_compress ? "blocks" : "rows");
+	return 1;
+}
+
 static int buffer_start(void)
 {
 	pthread_t thread;
 	int ret;
 
+	ret = pthread_create(&thread, NULL, &writer_routine, NULL);
+	if (ret) {
+		debug(DEBUG_ERROR, "could not create buffer writer thread: %s",
+		      strerror(errno));
+		return 0;
+	}
+
 	ret = pthread_create(&thread, NULL, &buffer_routine, NULL);
 	if (ret) {
 		debug(DEBUG_ERROR, "could not create buffer thread: %s",
 		      strerror(errno));
 		return 0;
 	}
+
+	if (!config.buffer_hot_rows)
+		return 1;
+	if (!hotq_init(config.buffer_hot_rows)) {
+		debug(DEBUG_ERROR, "could not allocate hot queue");
+		return 0;
+	}
+	ret = pthread_create(&thread, NULL, &hot_routine, NULL);
+	if (ret) {
+		debug(DEBUG_ERROR, "could not create hot tier thread: %s",
+		      strerror(errno));
+		return 0;
+	}
 	return 1;
 }
 
 int buffer_init(void)
 {
-	int ret;
+	struct buffer_conn *c = &wconn;
 	const char *cmd;
+	int ret;
 
-	ret = sqlite3_open(config.buffer_file, &bufdb);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not open buffer file: %s", sqlite3_errmsg(bufdb));
-		sqlite3_close(bufdb);
+	if (config.buffer_backend == CONFIG_BUFFER_LOG) {
+		ret = seglog_open(config.buffer_file);
+		if (!ret) {
+			debug(DEBUG_ERROR, "could not open buffer log %s", config.buffer_file);
+			return 0;
+		}
+		return buffer_start();
+	}
+
+	if (!buffer_open(c))
 		return 0;
+
+	/*
+	 * Drained pages are handed back by buffer_vacuum(). Files created
+	 * before need one full VACUUM for the setting to take effect.
+	 */
+	if (buffer_query(c, "PRAGMA auto_vacuum") != 2) {
+		sqlite3_exec(c->db, "PRAGMA auto_vacuum = INCREMENTAL", NULL, NULL, NULL);
+		ret = sqlite3_exec(c->db, "VACUUM", NULL, NULL, NULL);
+		if (ret != SQLITE_OK)
+			debug(DEBUG_WARNING, "could not vacuum buffer: %s", sqlite3_errmsg(c->db));
 	}
 
-	ret = sqlite3_exec(bufdb, "PRAGMA synchronous = 1", NULL, NULL, NULL);
+	/* Kept in the file, applies to rconn as well */
+	ret = sqlite3_exec(c->db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL);
 	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not set buffer option: %s", sqlite3_errmsg(bufdb));
-		sqlite3_close(bufdb);
+		debug(DEBUG_ERROR, "could not set buffer journal: %s", sqlite3_errmsg(c->db));
 		return 0;
 	}
 
-	/* Create buffer table */
-	cmd = "CREATE TABLE IF NOT EXISTS buffer("
+	/* Create record table, sender_ip is the ipv4 address in host order */
+	cmd = "CREATE TABLE IF NOT EXISTS record("
 	      "uid INTEGER PRIMARY KEY,"
-	      "client_name TEXT,"
-	      "client_ip TEXT,"
-              "sender_ip TEXT,"
-              "gps_tsp REAL,"
+	      "sender_ip INTEGER,"
+	      "gps_tsp REAL,"
+	      "recv_tsp REAL,"
 	      "gps_lat REAL,"
 	      "gps_lon REAL,"
 	      "packet_type INTEGER)";
-	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
+	ret = sqlite3_exec(c->db, cmd, NULL, NULL, NULL);
 	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not create table: %s", sqlite3_errmsg(bufdb));
+		debug(DEBUG_ERROR, "could not create table: %s", sqlite3_errmsg(c->db));
 		return 0;
 	}
 
+	/* Compressed blocks of buffer-compress, see recpack.c */
+	cmd = "CREATE TABLE IF NOT EXISTS block("
+	      "uid INTEGER PRIMARY KEY,"
+	      "count INTEGER,"
+	      "data BLOB)";
+	ret = sqlite3_exec(c->db, cmd, NULL, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not create table: %s", sqlite3_errmsg(c->db));
+		return 0;
+	}
+
+	if (!buffer_migrate(c) || !buffer_prepare_all(c))
+		return 0;
+
+	if (!buffer_convert(c))
+		return 0;
+	backlog_rows = buffer_count(c);
+
+	if (!buffer_open(&rconn) || !buffer_prepare_all(&rconn))
+		return 0;
+
 	/* Start buffer consumer and writer thread */
 	ret = buffer_start();
 	return ret;
 }
 
-int buffer_insert(const struct db_data *db)
+/*
+ * A producer found the hot queue full, the uploader is likely stuck in an
+ * upload. Switch to spilling and move what is queued to the writer thread
+ * ahead of the count records left, so nothing waits for the uploader and
+ * order is kept. Records the uploader popped before may still reach the
+ * disk after these if their upload fails.
+ */
+static void hot_overflow(const struct db_record *db,
+			 int count)
 {
-	char *cmd;
-	int ret;
+	int n;
 
-	cmd = sqlite3_mprintf("INSERT INTO buffer VALUES(NULL,'%q','%q','%q',%f,%f,%f,%i)",
-			      db->client_name, db->client_ip, db->sender_ip,
-			      db->gps_tsp, db->gps_lat, db->gps_lon, db->packet_type);
-	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
-	sqlite3_free(cmd);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not insert buffer: %s", sqlite3_errmsg(bufdb));
-		return 0;
+	pthread_mutex_lock(&hot_lock);
+	if (!__atomic_exchange_n(&hot_spill, 1, __ATOMIC_RELAXED))
+		debug(DEBUG_WARNING, "hot queue full, spilling to disk");
+	while ((n = hotq_pop(hot_move, BUFFER_DRAIN_ROWS)))
+		buffer_queue(hot_move, n);
+	buffer_queue(db, count);
+	pthread_mutex_unlock(&hot_lock);
+}
+
+/*
+ * Hand records to the hot tier, or to the writer thread without one. A
+ * record that finds the hot queue full moves the queue to the writer
+ * thread, it never bypasses records already in the queue.
+ *
+ * Records are stored asynchronously. Returns 0 while the buffer fails to
+ * store them, records handed over then may be lost too, see stats.lost.
+ */
+int buffer_insert_batch(const struct db_record *db,
+			int count)
+{
+	int i;
+
+	if (!config.buffer_hot_rows) {
+		buffer_queue(db, count);
+		return !__atomic_load_n(&commit_failed, __ATOMIC_RELAXED);
 	}
-	return 1;
+	for (i = 0; i < count; i++)
+		if (!hotq_push(&db[i])) {
+			hot_overflow(&db[i], count - i);
+			break;
+		}
+	return !__atomic_load_n(&commit_failed, __ATOMIC_RELAXED);
+}
+
+/* A single record, queued and committed like any batch */
+int buffer_insert(const struct db_record *db)
+{
+	return buffer_insert_batch(db, 1);
+}
+
+void buffer_get_stats(struct buffer_stats *st)
+{
+	pthread_mutex_lock(&stats_lock);
+	memcpy(st, &stats, sizeof(struct buffer_stats));
+	pthread_mutex_unlock(&stats_lock);
 }
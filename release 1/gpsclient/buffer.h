@@ -3,7 +3,18 @@
 
 #include "database.h"
 
+/* Drain thread statistics */
+struct buffer_stats {
+	int backlog;            /* rows waiting in the buffer */
+	double drain_rate;      /* rows/s uploaded during the last drain */
+	int batch;              /* current drain batch size */
+	unsigned evicted;       /* records dropped by buffer-evict */
+	unsigned lost;          /* records that could not be stored */
+};
+
 int buffer_init(void);
-int buffer_insert(const struct db_data *db);
+int buffer_insert(const struct db_record *db);
+int buffer_insert_batch(const struct db_record *db, int count);
+void buffer_get_stats(struct buffer_stats *stats);
 
 #endif /* _BUFFER_H_ */
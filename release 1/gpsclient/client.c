@@ -1,11 +1,22 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <gps.h>
+#ifdef HAVE_LIBURING
+#include <poll.h>
+#include <liburing.h>
+#endif
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
@@ -13,67 +24,127 @@
 #include "utils.h"
 #include "msg.h"
 #include "crc16.h"
+#include "msgcheck.h"
 #include "buffer.h"
 #include "config.h"
+#include "fixring.h"
 
+/* Manual record period in miliseconds */
+#define MANUAL_INTERVAL 5000
+
+/* Buffer status log period in ms, a multiple of MANUAL_INTERVAL */
+#define STATUS_INTERVAL 60000
+
+/* epoll tags for non listener descriptors, after CONFIG_BCAST */
+#define EVENT_GPSD  (CONFIG_BCAST + 1)
+#define EVENT_TIMER (CONFIG_BCAST + 2)
+
+/* Ancillary data room for one receive timestamp */
+union tstamp_control {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(3 * sizeof(struct timespec))];
+};
+
+/* Private to the gpsd reader, gps_read() parses into it without a lock */
 static struct gps_data_t gpsd;
-static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Latest fix published by the gpsd reader. seq is odd while the writer is
+ * copying, readers retry until they see the same even value on both sides
+ * of their copy.
+ */
+static struct {
+	unsigned seq;
+	int latlon_set;
+	struct gps_fix_t fix;
+} gpsfix;
+
+static void publish_gpsd(void)
+{
+	__atomic_store_n(&gpsfix.seq, gpsfix.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	gpsfix.latlon_set = gpsd.set & LATLON_SET;
+	memcpy(&gpsfix.fix, &gpsd.fix, sizeof(struct gps_fix_t));
+	__atomic_store_n(&gpsfix.seq, gpsfix.seq + 1, __ATOMIC_RELEASE);
+}
 
 static int read_gpsd(struct gps_fix_t *fix)
 {
 	int latlon_set;
+	unsigned seq;
 
-	pthread_rwlock_rdlock(&rwlock);
-	latlon_set = gpsd.set & LATLON_SET;
-	memcpy(fix, &gpsd.fix, sizeof(struct gps_fix_t));
-	pthread_rwlock_unlock(&rwlock);
+	do {
+		while ((seq = __atomic_load_n(&gpsfix.seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		latlon_set = gpsfix.latlon_set;
+		memcpy(fix, &gpsfix.fix, sizeof(struct gps_fix_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&gpsfix.seq, __ATOMIC_RELAXED) != seq);
 	return (latlon_set && fix->mode > MODE_NO_FIX);
 }
 
-static int process_msg(const struct tgr_msg *msg,
+/* Fix at time tsp, interpolated from the fix history */
+static int read_gpsd_at(double tsp,
+			struct gps_fix_t *fix)
+{
+	if (!read_gpsd(fix))
+		return 0;
+	fixring_lookup(tsp, fix);
+	return 1;
+}
+
+/*
+ * Sender address for log messages. Only called from debug() arguments,
+ * so it is skipped with the message when its level is off.
+ */
+static const char *addr_str(const struct sockaddr_in *addr,
+			    char *buf)
+{
+	if (!inet_ntop(AF_INET, &addr->sin_addr, buf, INET_ADDRSTRLEN))
+		return "?";
+	return buf;
+}
+
+/* Length check, then report the process_msgs() verdict of a message */
+static int msg_verdict(const struct tgr_msg *msg,
 		       const struct sockaddr_in *addr,
-		       size_t msg_len)
+		       size_t msg_len,
+		       int verdict)
 {
-	struct tgr_msg tmp;
 	char ip_str[INET_ADDRSTRLEN];
-	const char *ip_ptr;
-	unsigned short crc;	
-
-	ip_ptr = inet_ntop(AF_INET, &addr->sin_addr, ip_str, sizeof(ip_str));
-	if (ip_ptr == NULL) {
-		debug(DEBUG_INFO, "ip_ptr = NULL");
-		return 0;
-	}
 
 	if (msg_len < sizeof(struct tgr_msg)) {
-		debug(DEBUG_WARNING, "invalid msg length len=%i addr=%s", msg_len, ip_ptr);
+		debug(DEBUG_WARNING, "invalid msg length len=%zu addr=%s",
+		      msg_len, addr_str(addr, ip_str));
 		return 0;
 	}
 
-	if (!config.packet_validation)
-		return 1;
-
-	memcpy(&tmp, msg, sizeof(struct tgr_msg));
-	tmp.hdr = ntohs(tmp.hdr);
-	tmp.crc = ntohs(tmp.crc);
-	tmp.tsp = ntohl(tmp.tsp);
-
-	/* Check header */
-	if (tmp.hdr != MSG_HDR) {
-		debug(DEBUG_WARNING, "invalid header hdr=%.4x addr=%s", tmp.hdr, ip_ptr);
+	if (verdict == MSG_BAD_HDR) {
+		debug(DEBUG_WARNING, "invalid header hdr=%.4x addr=%s",
+		      ntohs(msg->hdr), addr_str(addr, ip_str));
 		return 0;
 	}
 
-	/* Check crc checksum */
-	crc = crc16(0, (char*) &tmp + 4, sizeof(tmp) - 4);
-	if (crc != tmp.crc) {
-		debug(DEBUG_WARNING, "invalid checksum crc=%.2x addr=%s", tmp.crc, ip_ptr);
+	if (verdict == MSG_BAD_CRC) {
+		debug(DEBUG_WARNING, "invalid checksum crc=%.2x addr=%s",
+		      ntohs(msg->crc), addr_str(addr, ip_str));
 		return 0;
 	}
 
 	return 1;
 }
 
+static int process_msg(const struct tgr_msg *msg,
+		       const struct sockaddr_in *addr,
+		       size_t msg_len)
+{
+	uint8_t verdict = MSG_VALID;
+
+	if (config.packet_validation && msg_len >= sizeof(struct tgr_msg))
+		process_msgs(msg, 1, &verdict);
+	return msg_verdict(msg, addr, msg_len, verdict);
+}
+
 static void set_sockaddr(struct sockaddr_in *saddr,
 			 const char *ipaddr,
 			 unsigned short port)
@@ -95,6 +166,94 @@ static void set_sockaddr(struct sockaddr_in *saddr,
 		saddr->sin_addr.s_addr = htonl(INADDR_ANY);
 }
 
+/*
+ * Drop short datagrams and datagrams with a wrong header in the kernel,
+ * before they are queued on the socket. A socket filter on an udp socket
+ * sees the packet from the udp header on, hence the UDP header offset.
+ */
+static int attach_filter(int sock)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+			 sizeof(struct udphdr) + sizeof(struct tgr_msg), 0, 3),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, sizeof(struct udphdr)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, MSG_HDR, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),	/* accept */
+		BPF_STMT(BPF_RET | BPF_K, 0),		/* drop */
+	};
+	struct sock_fprog prog;
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/*
+ * Ask the kernel to stamp every datagram on arrival. Hardware stamps also
+ * need rx timestamping switched on for the NIC (SIOCSHWTSTAMP), software
+ * stamps are reported when the NIC has none.
+ */
+static int enable_timestamp(int sock)
+{
+	int val;
+
+	if (config.recv_timestamp == CONFIG_TSTAMP_SOFTWARE) {
+		val = 1;
+		return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val));
+	} else if (config.recv_timestamp == CONFIG_TSTAMP_HARDWARE) {
+		/*
+		 * Raw hardware stamps are in the NIC clock, which nothing here
+		 * enables or keeps in step with CLOCK_REALTIME and gps time.
+		 * Only the software stamp taken at driver receive is used.
+		 */
+		val = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+		return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val));
+	}
+	return 0;
+}
+
+static double now_timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the arrival time carried by cmsg, or 0 if it has none */
+static double cmsg_timestamp(const struct cmsghdr *cmsg)
+{
+	struct timespec ts[3];
+
+	if (cmsg->cmsg_level != SOL_SOCKET)
+		return 0;
+	if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+		memcpy(ts, CMSG_DATA(cmsg), sizeof(struct timespec));
+		return ts[0].tv_sec + ts[0].tv_nsec / 1e9;
+	}
+	if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+		/* ts[0] is software, in CLOCK_REALTIME like the fix lookup */
+		memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+		return ts[0].tv_sec + ts[0].tv_nsec / 1e9;
+	}
+	return 0;
+}
+
+/* Arrival time of a received datagram, falls back to current time */
+static double msg_timestamp(struct msghdr *mh)
+{
+	struct cmsghdr *cmsg;
+	double tsp;
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		tsp = cmsg_timestamp(cmsg);
+		if (tsp)
+			return tsp;
+	}
+	return now_timestamp();
+}
+
 static int create_socket(int type,
 			 const char *addr,
 			 unsigned short port)
@@ -113,6 +272,14 @@ static int create_socket(int type,
 	if (ret == -1)
 		return ret;
 
+	/* Let the kernel spread unicast senders over the worker sockets */
+	if (type == CONFIG_UCAST && config.ucast_workers > 1) {
+		val = 1;
+		ret = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(int));
+		if (ret == -1)
+			return ret;
+	}
+
 	/* Specify multicast group */
 	if (type == CONFIG_MCAST) {
 		ret = inet_pton(AF_INET, config.mcast_gaddr, &iaddr);
@@ -129,6 +296,17 @@ static int create_socket(int type,
 			return ret;
 	}
 
+	ret = enable_timestamp(sock);
+	if (ret == -1)
+		debug(DEBUG_WARNING, "could not enable receive timestamps: %s", strerror(errno));
+
+	/* Userspace checks in process_msg() stay as second line */
+	if (config.packet_validation) {
+		ret = attach_filter(sock);
+		if (ret == -1)
+			debug(DEBUG_WARNING, "could not attach packet filter: %s", strerror(errno));
+	}
+
 	set_sockaddr(&saddr, addr, port);
 	ret = bind(sock, (struct sockaddr*) &saddr, sizeof(struct sockaddr_in));
 	if (ret == -1)
@@ -136,55 +314,188 @@ static int create_socket(int type,
 	return sock;
 }
 
-static void fill_db_data(const struct in_addr *addr,
-			 const struct gps_fix_t *fix,
-			 struct db_data *db,
-			 int type)
+/* Only per-packet fields are stored, db_record_unpack() adds the rest */
+static void fill_db_record(const struct in_addr *addr,
+			   const struct gps_fix_t *fix,
+			   double recv_tsp,
+			   struct db_record *rec,
+			   int type)
 {
-	char ip_str[INET_ADDRSTRLEN];
-	const char *ip_ptr;
+	rec->sender_ip = addr ? addr->s_addr : 0;
+	rec->gps_tsp = fix->time;
+	rec->recv_tsp = recv_tsp;
+	rec->gps_lat = fix->latitude;
+	rec->gps_lon = fix->longitude;
+	rec->packet_type = type;
+	memset(rec->__reserved, 0, sizeof(rec->__reserved));
+}
 
-	if (addr) {
-		ip_ptr = inet_ntop(AF_INET, addr, ip_str, sizeof(ip_str));
-		sprintf(db->sender_ip, "%s", ip_ptr);
-	} else
-		memset(db->sender_ip, 0, sizeof(db->sender_ip));
+/* Buffer records, warning once whenever the buffer starts losing them */
+static void store_records(const struct db_record *db,
+			  int count)
+{
+	static int failing;
+	int ok;
+
+	ok = buffer_insert_batch(db, count);
+	if (!ok && !__atomic_exchange_n(&failing, 1, __ATOMIC_RELAXED))
+		debug(DEBUG_WARNING, "buffer is losing records");
+	else if (ok && failing)
+		__atomic_store_n(&failing, 0, __ATOMIC_RELAXED);
+}
 
+static const char *type_str(int type)
+{
 	if (type == CONFIG_UCAST)
-		sprintf(db->client_ip, config.ucast_addr, sizeof(db->client_ip));
+		return "ucast";
 	else if (type == CONFIG_MCAST)
-		sprintf(db->client_ip, config.mcast_addr, sizeof(db->client_ip));
+		return "mcast";
 	else if (type == CONFIG_BCAST)
-		sprintf(db->client_ip, config.bcast_addr, sizeof(db->client_ip));
+		return "bcast";
+	return "manual";
+}
+
+/*
+ * Receive up to config.recv_batch messages with a single recvmmsg() call.
+ * The whole batch is validated, tagged with one gps fix and written to the
+ * buffer in one transaction. msg must hold config.recv_batch messages.
+ * Returns the number of datagrams read, or -1 if nothing could be read.
+ */
+static int recv_batch_once(int sock,
+			   int type,
+			   struct tgr_msg *msg,
+			   int flags)
+{
+	struct mmsghdr mmsg[CONFIG_RECV_BATCH_MAX];
+	struct mmsghdr ack[CONFIG_RECV_BATCH_MAX];
+	struct iovec iov[CONFIG_RECV_BATCH_MAX];
+	struct sockaddr_in addr[CONFIG_RECV_BATCH_MAX];
+	union tstamp_control control[CONFIG_RECV_BATCH_MAX];
+	double tsp[CONFIG_RECV_BATCH_MAX];
+	struct db_record dbdata[CONFIG_RECV_BATCH_MAX];
+	uint8_t verdict[CONFIG_RECV_BATCH_MAX];
+	struct gps_fix_t fix, tfix;
+	int ret, i, n, nvalid, nack;
+	const char *str = type_str(type);
+
+	for (i = 0; i < config.recv_batch; i++) {
+		iov[i].iov_base = &msg[i];
+		iov[i].iov_len = sizeof(struct tgr_msg);
+		memset(&mmsg[i].msg_hdr, 0, sizeof(struct msghdr));
+		mmsg[i].msg_hdr.msg_name = &addr[i];
+		mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		mmsg[i].msg_hdr.msg_control = control[i].buf;
+		mmsg[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+	}
+
+	n = recvmmsg(sock, mmsg, config.recv_batch, flags, NULL);
+	if (n == -1) {
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			debug(DEBUG_WARNING, "type=%s recvmmsg: %s", str, strerror(errno));
+		return -1;
+	}
+
+	/* Validate all at once, every slot holds a whole message */
+	if (config.packet_validation)
+		process_msgs(msg, n, verdict);
 	else
-		memset(db->client_ip, 0, sizeof(db->client_ip));
+		memset(verdict, MSG_VALID, n);
 
-	sprintf(db->client_name, "%s", config.client_name);
-	db->gps_tsp = fix->time;
-	db->gps_lat = fix->latitude;
-	db->gps_lon = fix->longitude;
-	db->packet_type = type;
+	/* Compact valid messages to the front of the batch */
+	nvalid = 0;
+	for (i = 0; i < n; i++) {
+		ret = msg_verdict(&msg[i], &addr[i], mmsg[i].msg_len, verdict[i]);
+		if (!ret)
+			continue;
+		tsp[nvalid] = msg_timestamp(&mmsg[i].msg_hdr);
+		if (i != nvalid) {
+			memcpy(&msg[nvalid], &msg[i], sizeof(struct tgr_msg));
+			addr[nvalid] = addr[i];
+		}
+		nvalid++;
+	}
+	if (!nvalid)
+		return n;
+
+	/* Send ack replies to senders for unicast socket */
+	if (type == CONFIG_UCAST) {
+		for (i = 0; i < nvalid; i++) {
+			memset(&ack[i].msg_hdr, 0, sizeof(struct msghdr));
+			iov[i].iov_base = &msg[i];
+			iov[i].iov_len = sizeof(struct tgr_msg);
+			ack[i].msg_hdr.msg_name = &addr[i];
+			ack[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			ack[i].msg_hdr.msg_iov = &iov[i];
+			ack[i].msg_hdr.msg_iovlen = 1;
+		}
+		for (i = 0; i < nvalid; i += nack) {
+			nack = sendmmsg(sock, &ack[i], nvalid - i, 0);
+			if (nack == -1) {
+				debug(DEBUG_WARNING, "type=%s sendmmsg: %s", str, strerror(errno));
+				break;
+			}
+		}
+	}
+
+	debug(DEBUG_INFO, "msg batch recvd type=%s count=%i valid=%i", str, n, nvalid);
+
+	ret = read_gpsd(&fix);
+	if (!ret) {
+		debug(DEBUG_WARNING, "no data from gpsd type=%s count=%i", str, nvalid);
+		return n;
+	}
+	if (isnan(fix.time) || isnan(fix.latitude) || isnan(fix.longitude)) {
+		debug(DEBUG_WARNING, "invalid gps value (NAN)");
+		return n;
+	}
+	for (i = 0; i < nvalid; i++) {
+		memcpy(&tfix, &fix, sizeof(struct gps_fix_t));
+		fixring_lookup(tsp[i], &tfix);
+		fill_db_record(&addr[i].sin_addr, &tfix, tsp[i], &dbdata[i], type);
+	}
+	store_records(dbdata, nvalid);
+	return n;
+}
+
+static void recv_msg_batch(int sock,
+			   int type)
+{
+	struct tgr_msg *msg;
+
+	msg = calloc(config.recv_batch, sizeof(struct tgr_msg));
+	if (!msg) {
+		debug(DEBUG_ERROR, "type=%s could not allocate recv batch", type_str(type));
+		_exit(EXIT_FAILURE);
+	}
+
+	/* Block for the first datagram, then take whatever is queued */
+	while (1)
+		recv_batch_once(sock, type, msg, MSG_WAITFORONE);
 }
 
 static void recv_msg(int sock,
 		     int type)
 {
 	struct sockaddr_in addr;
-	struct db_data dbdata;
+	struct db_record dbdata;
 	struct tgr_msg msg;
 	struct gps_fix_t fix;
+	struct msghdr mh;
+	struct iovec iov;
+	union tstamp_control control;
 	fd_set rset;
 	int ret;
 	unsigned socklen;
+	double tsp;
 	char ipstr[INET_ADDRSTRLEN];
-	const char *str;
+	const char *str = type_str(type);
 
-	if (type == CONFIG_UCAST)
-		str = "ucast";
-	else if (type == CONFIG_MCAST)
-		str = "mcast";
-	else /* CONFIG_BCAST */
-		str = "bcast";
+	if (config.recv_batch > 1) {
+		recv_msg_batch(sock, type);
+		return;
+	}
 
 	while (1) {
 		FD_ZERO(&rset);
@@ -196,17 +507,25 @@ static void recv_msg(int sock,
 		}
 		if (!FD_ISSET(sock, &rset))
 			continue;
-		socklen = sizeof(struct sockaddr_in);
-		ret = recvfrom(sock, &msg, sizeof(struct tgr_msg), 0,
-			       (struct sockaddr*) &addr, &socklen);
+		iov.iov_base = &msg;
+		iov.iov_len = sizeof(struct tgr_msg);
+		memset(&mh, 0, sizeof(struct msghdr));
+		mh.msg_name = &addr;
+		mh.msg_namelen = sizeof(struct sockaddr_in);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+		ret = recvmsg(sock, &mh, 0);
 		if (ret == -1) {
-			debug(DEBUG_WARNING, "type=%s recvfrom: %s", str, strerror(errno));
+			debug(DEBUG_WARNING, "type=%s recvmsg: %s", str, strerror(errno));
 			continue;
 		}
 
 		ret = process_msg(&msg, &addr, ret);
 		if (!ret)
 			continue;
+		tsp = msg_timestamp(&mh);
 
 		/* Send ack reply to sender for unicast socket */
 		if (type == CONFIG_UCAST) {
@@ -217,33 +536,78 @@ static void recv_msg(int sock,
 				debug(DEBUG_WARNING, "type=%s sendto: %s", str, strerror(errno));
 		}
 
-		inet_ntop(AF_INET, &addr.sin_addr, ipstr, sizeof(ipstr));
-		debug(DEBUG_INFO, "msg recvd type=%s addr=%s", str, ipstr);
+		debug(DEBUG_INFO, "msg recvd type=%s addr=%s", str, addr_str(&addr, ipstr));
 
-		ret = read_gpsd(&fix);
+		ret = read_gpsd_at(tsp, &fix);
 		if (ret) {
-			debug(DEBUG_INFO, "type=%s addr=%s tsp=%f lat=%f lon=%f", 
-			      str, ipstr, fix.time, fix.latitude, fix.longitude);
+			debug(DEBUG_INFO, "type=%s addr=%s recv=%f tsp=%f lat=%f lon=%f",
+			      str, addr_str(&addr, ipstr), tsp, fix.time, fix.latitude, fix.longitude);
 			if (isnan(fix.time) || isnan(fix.latitude) || isnan(fix.longitude)) {
 				debug(DEBUG_WARNING, "invalid gps value (NAN)");
 				continue;
 			}
-			fill_db_data(&addr.sin_addr, &fix, &dbdata, type);
-			buffer_insert(&dbdata);
+			fill_db_record(&addr.sin_addr, &fix, tsp, &dbdata, type);
+			store_records(&dbdata, 1);
 		} else
-			debug(DEBUG_WARNING, "no data from gpsd type=%s addr=%s", str, ipstr);
+			debug(DEBUG_WARNING, "no data from gpsd type=%s addr=%s",
+			      str, addr_str(&addr, ipstr));
 	}
 }
 
+static int open_socket(int type)
+{
+	int sock;
+
+	if (type == CONFIG_UCAST) {
+		sock = create_socket(CONFIG_UCAST, config.ucast_addr, config.ucast_port);
+		if (sock == -1)
+			debug(DEBUG_ERROR, "could not create unicast socket: %s", strerror(errno));
+	} else if (type == CONFIG_MCAST) {
+		sock = create_socket(CONFIG_MCAST, config.mcast_addr, config.mcast_port);
+		if (sock == -1)
+			debug(DEBUG_ERROR, "could not create mcast socket: %s", strerror(errno));
+	} else {
+		sock = create_socket(CONFIG_BCAST, config.bcast_addr, config.bcast_port);
+		if (sock == -1 && errno == EADDRNOTAVAIL) {
+			debug(DEBUG_ERROR, "could not create broadcast at %s,"
+			      " fallback to 0.0.0.0", config.bcast_addr);
+			sock = create_socket(CONFIG_BCAST, "0.0.0.0", config.bcast_port);
+		}
+		if (sock == -1)
+			debug(DEBUG_ERROR, "could not create broadcast socket: %s",
+			      strerror(errno));
+	}
+	return sock;
+}
+
+static void pin_thread(int worker)
+{
+	cpu_set_t cpus;
+	long ncpu;
+	int ret;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu <= 0)
+		return;
+	CPU_ZERO(&cpus);
+	CPU_SET(worker % ncpu, &cpus);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret)
+		debug(DEBUG_WARNING, "could not pin ucast worker %i: %s", worker, strerror(ret));
+}
+
+/* data is the worker index, each worker owns one SO_REUSEPORT socket */
 static void *unicast_routine(void *data)
 {
 	int sock;
+	int worker = (long) data;
+
+	if (config.ucast_cpu_pin)
+		pin_thread(worker);
 
-	sock = create_socket(CONFIG_UCAST, config.ucast_addr, config.ucast_port);
-	if (sock == -1) {
-		debug(DEBUG_ERROR, "could not create unicast socket: %s", strerror(errno));
+	sock = open_socket(CONFIG_UCAST);
+	if (sock == -1)
 		_exit(EXIT_FAILURE);
-	}
 
 	while (1) {
 		recv_msg(sock, CONFIG_UCAST);
@@ -256,11 +620,9 @@ static void *multicast_routine(void *data)
 {
 	int sock;
 
-	sock = create_socket(CONFIG_MCAST, config.mcast_addr, config.mcast_port);
-	if (sock == -1) {
-		debug(DEBUG_ERROR, "could not create mcast socket: %s", strerror(errno));
+	sock = open_socket(CONFIG_MCAST);
+	if (sock == -1)
 		_exit(EXIT_FAILURE);
-	}
 
 	while (1) {
 		recv_msg(sock, CONFIG_MCAST);
@@ -272,19 +634,9 @@ static void *broadcast_routine(void *data)
 {
 	int sock;
 
-	sock = create_socket(CONFIG_BCAST, config.bcast_addr, config.bcast_port);
-	if (sock == -1) {
-		if (errno == EADDRNOTAVAIL) {
-			debug(DEBUG_ERROR, "could not create broadcast at %s,"
-			      " fallback to 0.0.0.0", config.bcast_addr);
-			sock = create_socket(CONFIG_BCAST, "0.0.0.0", config.bcast_port);
-			if (sock == -1) {
-				debug(DEBUG_ERROR, "could not create broadcast socket: %s",
-				      strerror(errno));
-				_exit(EXIT_FAILURE);
-			}
-		}
-	}
+	sock = open_socket(CONFIG_BCAST);
+	if (sock == -1)
+		_exit(EXIT_FAILURE);
 
 	while (1) {
 		recv_msg(sock, CONFIG_BCAST);
@@ -293,30 +645,486 @@ static void *broadcast_routine(void *data)
 	return NULL;
 }
 
+/* Called on every manual record tick, logs every STATUS_INTERVAL */
+static void log_status(void)
+{
+	static unsigned ticks;
+	struct buffer_stats st;
+	struct db_stats dst;
+
+	if (++ticks < STATUS_INTERVAL / MANUAL_INTERVAL)
+		return;
+	ticks = 0;
+	buffer_get_stats(&st);
+	debug(st.lost ? DEBUG_WARNING : DEBUG_INFO,
+	      "buffer backlog=%i rate=%.1f/s batch=%i evicted=%u lost=%u",
+	      st.backlog, st.drain_rate, st.batch, st.evicted, st.lost);
+	db_get_stats(&dst);
+	debug(DEBUG_INFO, "db conn age=%lis connects=%u failures=%u",
+	      (long) (time(NULL) - dst.connected), dst.connects, dst.failures);
+}
+
+static void manual_insert(void)
+{
+	struct gps_fix_t fix;
+	struct db_record db;
+
+	log_status();
+
+	if (read_gpsd_at(now_timestamp(), &fix)) {
+		fill_db_record(NULL, &fix, 0, &db, CONFIG_MANUAL);
+		store_records(&db, 1);
+	}
+}
+
 static void *manual_routine(void *data)
+{
+	while (1) {
+		manual_insert();
+		msleep(MANUAL_INTERVAL);
+	}
+	return NULL;
+}
+
+static void read_gpsd_socket(void)
 {
 	int ret;
-	struct gps_fix_t fix;
-	struct db_data db;
+
+	ret = gps_read(&gpsd);
+	if (ret == -1) {
+		debug(DEBUG_ERROR, "could not read gpsd: %s", gps_errstr(errno));
+		_exit(EXIT_FAILURE);
+	}
+	publish_gpsd();
+
+	if ((gpsd.set & LATLON_SET) && gpsd.fix.mode > MODE_NO_FIX &&
+	    !isnan(gpsd.fix.time) && !isnan(gpsd.fix.latitude) &&
+	    !isnan(gpsd.fix.longitude))
+		fixring_push(&gpsd.fix);
+}
+
+/* Periodic timerfd driving the manual record */
+static int create_timer(void)
+{
+	struct itimerspec its;
+	int tfd;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (tfd == -1) {
+		debug(DEBUG_ERROR, "timerfd_create: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	its.it_value.tv_sec = MANUAL_INTERVAL / 1000;
+	its.it_value.tv_nsec = 0;
+	its.it_interval = its.it_value;
+	timerfd_settime(tfd, 0, &its, NULL);
+	return tfd;
+}
+
+/*
+ * Single threaded event loop. One epoll set owns the three listener sockets,
+ * the gpsd socket and a timerfd driving the manual record, so no receiver
+ * ever waits on the gpsd lock.
+ */
+static void event_loop(void)
+{
+	struct epoll_event ev, events[8];
+	struct tgr_msg *msg;
+	int epfd, tfd, sock[4], type, i, n;
+	uint64_t expired;
+
+	msg = calloc(config.recv_batch, sizeof(struct tgr_msg));
+	if (!msg) {
+		debug(DEBUG_ERROR, "could not allocate recv batch");
+		_exit(EXIT_FAILURE);
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		debug(DEBUG_ERROR, "epoll_create1: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	/* Listener sockets, indexed by packet type */
+	for (type = CONFIG_UCAST; type <= CONFIG_BCAST; type++) {
+		sock[type] = open_socket(type);
+		if (sock[type] == -1)
+			_exit(EXIT_FAILURE);
+		ev.events = EPOLLIN;
+		ev.data.u32 = type;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock[type], &ev) == -1) {
+			debug(DEBUG_ERROR, "epoll_ctl: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	/* gpsd socket */
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENT_GPSD;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, gpsd.gps_fd, &ev) == -1) {
+		debug(DEBUG_ERROR, "epoll_ctl gpsd: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	/* Manual record timer */
+	tfd = create_timer();
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENT_TIMER;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+	debug(DEBUG_INFO, "epoll event loop started");
 
 	while (1) {
-		ret = read_gpsd(&fix);
-		if (ret) {
-			fill_db_data(NULL, &fix, &db, CONFIG_MANUAL);
-			buffer_insert(&db);
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			debug(DEBUG_ERROR, "epoll_wait: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < n; i++) {
+			type = events[i].data.u32;
+			if (type == EVENT_GPSD) {
+				/* libgps may hold more than one report in its buffer */
+				do {
+					read_gpsd_socket();
+				} while (gps_waiting(&gpsd, 0));
+			} else if (type == EVENT_TIMER) {
+				if (read(tfd, &expired, sizeof(expired)) > 0)
+					manual_insert();
+			} else
+				recv_batch_once(sock[type], type, msg, MSG_DONTWAIT);
 		}
-		msleep(5000);
 	}
-	return NULL;
 }
 
+#ifdef HAVE_LIBURING
+/*
+ * io_uring backend. Every listener socket has one multishot recvmsg armed
+ * on its own provided buffer ring, gpsd and the manual timer are watched
+ * with multishot polls, and unicast acks are queued as linked sendmsg
+ * requests. All completions reaped in one pass are tagged with a single
+ * gps fix and buffered in one transaction.
+ */
+#define URING_ENTRIES 256
+#define URING_BUFS    256	/* provided buffers per socket, power of 2 */
+#define URING_ACKS    64	/* acks in flight */
+#define URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + \
+			sizeof(struct sockaddr_in) + sizeof(union tstamp_control) + \
+			sizeof(struct tgr_msg))
+
+/* user_data layout: event tag in the low byte, ack slot above it */
+#define EVENT_ACK      (CONFIG_BCAST + 3)
+#define URING_TAG(d)   ((d) & 0xff)
+#define URING_SLOT(d)  ((d) >> 8)
+
+struct uring_sock {
+	int fd;
+	struct msghdr msgh;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+};
+
+struct uring_ack {
+	struct tgr_msg msg;
+	struct sockaddr_in addr;
+	struct iovec iov;
+	struct msghdr msgh;
+	int busy;
+};
+
+static struct io_uring ring;
+static struct uring_sock usock[CONFIG_BCAST + 1];
+static struct uring_ack uack[URING_ACKS];
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		/* Submission queue full, flush it and retry */
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	if (!sqe) {
+		debug(DEBUG_ERROR, "io_uring submission queue full");
+		_exit(EXIT_FAILURE);
+	}
+	return sqe;
+}
+
+static void uring_arm_recv(int type)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe();
+	io_uring_prep_recvmsg_multishot(sqe, usock[type].fd, &usock[type].msgh, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = type;
+	io_uring_sqe_set_data64(sqe, type);
+}
+
+static void uring_arm_poll(int fd,
+			   int tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe();
+	io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+	io_uring_sqe_set_data64(sqe, tag);
+}
+
+static void uring_recycle(int type,
+			  int bid)
+{
+	io_uring_buf_ring_add(usock[type].br, usock[type].bufs + bid * URING_BUF_SIZE,
+			      URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUFS), 0);
+	io_uring_buf_ring_advance(usock[type].br, 1);
+}
+
+/*
+ * Queue an ack on its own, acks of different senders must not cancel
+ * each other. The ack slots bound how many are in flight.
+ */
+static void uring_queue_ack(int sock,
+			    const struct tgr_msg *msg,
+			    const struct sockaddr_in *addr)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_ack *ack;
+	static int next;
+	int i, slot;
+
+	for (i = 0; i < URING_ACKS; i++) {
+		slot = (next + i) % URING_ACKS;
+		if (!uack[slot].busy)
+			break;
+	}
+	if (i == URING_ACKS) {
+		debug(DEBUG_WARNING, "type=ucast no free ack slot, ack dropped");
+		return;
+	}
+	next = slot + 1;
+
+	ack = &uack[slot];
+	memcpy(&ack->msg, msg, sizeof(struct tgr_msg));
+	ack->addr = *addr;
+	ack->iov.iov_base = &ack->msg;
+	ack->iov.iov_len = sizeof(struct tgr_msg);
+	memset(&ack->msgh, 0, sizeof(struct msghdr));
+	ack->msgh.msg_name = &ack->addr;
+	ack->msgh.msg_namelen = sizeof(struct sockaddr_in);
+	ack->msgh.msg_iov = &ack->iov;
+	ack->msgh.msg_iovlen = 1;
+	ack->busy = 1;
+
+	sqe = uring_sqe();
+	io_uring_prep_sendmsg(sqe, sock, &ack->msgh, 0);
+	io_uring_sqe_set_data64(sqe, EVENT_ACK | ((uint64_t) slot << 8));
+}
+
+static void uring_cleanup(void)
+{
+	int type;
+
+	for (type = CONFIG_UCAST; type <= CONFIG_BCAST; type++) {
+		if (usock[type].br)
+			io_uring_free_buf_ring(&ring, usock[type].br, URING_BUFS, type);
+		if (usock[type].fd > 0)
+			close(usock[type].fd);
+		free(usock[type].bufs);
+	}
+	memset(usock, 0, sizeof(usock));
+	io_uring_queue_exit(&ring);
+}
+
+/* Tag the valid messages of a pass with gps fixes and buffer them */
+static void uring_insert(const struct sockaddr_in *addr,
+			 const double *tsp,
+			 const int *types,
+			 int n)
+{
+	struct db_record dbdata[CONFIG_RECV_BATCH_MAX];
+	struct gps_fix_t fix, tfix;
+	int ret, i;
+
+	debug(DEBUG_INFO, "msg batch recvd backend=io_uring valid=%i", n);
+
+	ret = read_gpsd(&fix);
+	if (!ret) {
+		debug(DEBUG_WARNING, "no data from gpsd count=%i", n);
+		return;
+	}
+	if (isnan(fix.time) || isnan(fix.latitude) || isnan(fix.longitude)) {
+		debug(DEBUG_WARNING, "invalid gps value (NAN)");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		memcpy(&tfix, &fix, sizeof(struct gps_fix_t));
+		fixring_lookup(tsp[i], &tfix);
+		fill_db_record(&addr[i].sin_addr, &tfix, tsp[i], &dbdata[i], types[i]);
+	}
+	store_records(dbdata, n);
+}
+
+/*
+ * Runs forever on success. Returns 0 when io_uring or one of the required
+ * features is not available, so the caller can fall back to sockets.
+ */
+static int uring_loop(void)
+{
+	struct io_uring_cqe *cqe;
+	struct io_uring_recvmsg_out *out;
+	struct sockaddr_in addr[CONFIG_RECV_BATCH_MAX];
+	int types[CONFIG_RECV_BATCH_MAX];
+	double tsp[CONFIG_RECV_BATCH_MAX];
+	struct cmsghdr *cmsg;
+	const struct tgr_msg *msg;
+	uint64_t data, expired;
+	unsigned head, count, len;
+	int ret, type, tag, bid, i, n, tfd, received = 0;
+	char *buf;
+
+	ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+	if (ret < 0) {
+		debug(DEBUG_WARNING, "io_uring_queue_init: %s", strerror(-ret));
+		return 0;
+	}
+
+	for (type = CONFIG_UCAST; type <= CONFIG_BCAST; type++) {
+		usock[type].br = io_uring_setup_buf_ring(&ring, URING_BUFS, type, 0, &ret);
+		if (!usock[type].br) {
+			debug(DEBUG_WARNING, "io_uring_setup_buf_ring: %s", strerror(-ret));
+			uring_cleanup();
+			return 0;
+		}
+		usock[type].bufs = malloc(URING_BUFS * URING_BUF_SIZE);
+		if (!usock[type].bufs) {
+			debug(DEBUG_ERROR, "could not allocate io_uring buffers");
+			_exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < URING_BUFS; i++)
+			uring_recycle(type, i);
+
+		usock[type].fd = open_socket(type);
+		if (usock[type].fd == -1)
+			_exit(EXIT_FAILURE);
+		usock[type].msgh.msg_namelen = sizeof(struct sockaddr_in);
+		usock[type].msgh.msg_controllen = sizeof(union tstamp_control);
+		uring_arm_recv(type);
+	}
+
+	tfd = create_timer();
+	uring_arm_poll(gpsd.gps_fd, EVENT_GPSD);
+	uring_arm_poll(tfd, EVENT_TIMER);
+
+	debug(DEBUG_INFO, "io_uring event loop started");
+
+	while (1) {
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			debug(DEBUG_ERROR, "io_uring_submit_and_wait: %s", strerror(-ret));
+			_exit(EXIT_FAILURE);
+		}
+
+		n = 0;
+		count = 0;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			count++;
+			data = io_uring_cqe_get_data64(cqe);
+			tag = URING_TAG(data);
+
+			if (tag == EVENT_ACK) {
+				uack[URING_SLOT(data)].busy = 0;
+				if (cqe->res < 0)
+					debug(DEBUG_WARNING, "type=ucast sendmsg: %s", strerror(-cqe->res));
+				continue;
+			}
+
+			if (tag == EVENT_GPSD || tag == EVENT_TIMER) {
+				if (tag == EVENT_GPSD) {
+					/* libgps may hold more than one report in its buffer */
+					do {
+						read_gpsd_socket();
+					} while (gps_waiting(&gpsd, 0));
+				} else if (read(tfd, &expired, sizeof(expired)) > 0)
+					manual_insert();
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					uring_arm_poll(tag == EVENT_GPSD ? gpsd.gps_fd : tfd, tag);
+				continue;
+			}
+
+			/* Listener socket */
+			type = tag;
+			if (cqe->res < 0) {
+				if (!received && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)) {
+					debug(DEBUG_WARNING, "io_uring multishot recvmsg unsupported");
+					uring_cleanup();
+					close(tfd);
+					return 0;
+				}
+				if (cqe->res != -ENOBUFS)
+					debug(DEBUG_WARNING, "type=%s recvmsg: %s", type_str(type),
+					      strerror(-cqe->res));
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					uring_arm_recv(type);
+				continue;
+			}
+			received = 1;
+
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			buf = usock[type].bufs + bid * URING_BUF_SIZE;
+			out = io_uring_recvmsg_validate(buf, cqe->res, &usock[type].msgh);
+			if (out) {
+				msg = io_uring_recvmsg_payload(out, &usock[type].msgh);
+				len = io_uring_recvmsg_payload_length(out, cqe->res, &usock[type].msgh);
+				memcpy(&addr[n], io_uring_recvmsg_name(out), sizeof(struct sockaddr_in));
+				if (process_msg(msg, &addr[n], len)) {
+					if (type == CONFIG_UCAST)
+						uring_queue_ack(usock[type].fd, msg, &addr[n]);
+					tsp[n] = 0;
+					cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &usock[type].msgh);
+					for (; cmsg && !tsp[n];
+					     cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &usock[type].msgh, cmsg))
+						tsp[n] = cmsg_timestamp(cmsg);
+					if (!tsp[n])
+						tsp[n] = now_timestamp();
+					types[n++] = type;
+				}
+				/* A pass may reap more than a batch, insert as it fills */
+				if (n == CONFIG_RECV_BATCH_MAX) {
+					uring_insert(addr, tsp, types, n);
+					n = 0;
+				}
+			}
+			uring_recycle(type, bid);
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_arm_recv(type);
+		}
+		io_uring_cq_advance(&ring, count);
+
+		if (n)
+			uring_insert(addr, tsp, types, n);
+	}
+}
+#else
+static int uring_loop(void)
+{
+	debug(DEBUG_WARNING, "built without io_uring support");
+	return 0;
+}
+#endif /* HAVE_LIBURING */
+
 int main(int argc,
 	 char **argv)
 {
-	pthread_t thread[4];
+	pthread_t thread[CONFIG_UCAST_WORKERS_MAX + 3];
 	char gpsd_port[5];
-	int ret;
+	int ret, i, nthread;
 	char *progname, *tmp;
+	const char *kernel;
 
 	progname = argv[0];
 	if ((tmp = strstr(argv[0], "/")))
@@ -333,6 +1141,15 @@ int main(int argc,
 		exit(EXIT_FAILURE);
 	}
 
+	/* Log from here on through the log thread */
+	ret = log_init(config.log_level);
+	if (!ret)
+		debug(DEBUG_WARNING, "could not create log thread, logging synchronously");
+
+	/* Self-test and select the fastest crc16 kernel */
+	kernel = crc16_init();
+	debug(DEBUG_INFO, "crc16 kernel=%s", kernel);
+
 	/* Initialize GPSD connection */
 	sprintf(gpsd_port, "%i", config.gpsd_port);
 	ret = gps_open(config.gpsd_addr, gpsd_port, &gpsd);
@@ -355,25 +1172,39 @@ int main(int argc,
 		exit(EXIT_FAILURE);
 	}
 
-	ret = pthread_create(&thread[0], NULL, unicast_routine, NULL);
-	if (ret) {
-		debug(DEBUG_ERROR, "could not create unicast thread");
-		_exit(EXIT_FAILURE);
+	if (config.io_backend == CONFIG_IO_URING) {
+		uring_loop();
+		/* Only returns when io_uring is unavailable */
+		debug(DEBUG_WARNING, "io_uring backend unavailable, fallback to sockets");
+	}
+
+	if (config.event_loop == CONFIG_LOOP_EPOLL) {
+		event_loop();
+		/* Not reached */
 	}
 
-	ret = pthread_create(&thread[1], NULL, broadcast_routine, NULL);
+	for (i = 0; i < config.ucast_workers; i++) {
+		ret = pthread_create(&thread[i], NULL, unicast_routine, (void*) (long) i);
+		if (ret) {
+			debug(DEBUG_ERROR, "could not create unicast thread");
+			_exit(EXIT_FAILURE);
+		}
+	}
+	nthread = i;
+
+	ret = pthread_create(&thread[nthread++], NULL, broadcast_routine, NULL);
 	if (ret) {
 		debug(DEBUG_ERROR, "could not create broadcast thread");
 		_exit(EXIT_FAILURE);
 	}
 
-	ret = pthread_create(&thread[2], NULL, multicast_routine, NULL);
+	ret = pthread_create(&thread[nthread++], NULL, multicast_routine, NULL);
 	if (ret) {
 		debug(DEBUG_ERROR, "could not create multicast thread\n");
 		_exit(EXIT_FAILURE);
 	}
 
-	ret = pthread_create(&thread[3], NULL, manual_routine, NULL);
+	ret = pthread_create(&thread[nthread++], NULL, manual_routine, NULL);
 	if (ret) {
 		debug(DEBUG_ERROR, "could not create manual thread\n");
 		_exit(EXIT_FAILURE);
@@ -382,22 +1213,13 @@ int main(int argc,
 	/* Loop forever to check new data then read  */
 	while (1) {
 		ret = gps_waiting(&gpsd, 1000);
-		if (ret) {
-			pthread_rwlock_wrlock(&rwlock);
-			ret = gps_read(&gpsd);
-			pthread_rwlock_unlock(&rwlock);
-			if (ret == -1) {
-				debug(DEBUG_ERROR, "could not read gpsd: %s", gps_errstr(errno));
-				_exit(EXIT_FAILURE);
-			}
-		}
+		if (ret)
+			read_gpsd_socket();
 	}
 
 	/* Not reached */
 	gps_close(&gpsd);
-	pthread_join(thread[0], NULL);
-	pthread_join(thread[1], NULL);
-	pthread_join(thread[2], NULL);
-	pthread_join(thread[3], NULL);	
+	for (i = 0; i < nthread; i++)
+		pthread_join(thread[i], NULL);
 	_exit(EXIT_SUCCESS);
 }
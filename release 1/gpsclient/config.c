@@ -24,6 +24,26 @@ static const char * const config_keys[] = {
 	"db-passwd",
 	"buffer-file",
 	"buffer-interval",
+	"recv-batch",
+	"event-loop",
+	"ucast-workers",
+	"ucast-cpu-pin",
+	"io-backend",
+	"recv-timestamp",
+	"buffer-commit-rows",
+	"buffer-commit-ms",
+	"db-retry-max",
+	"db-upload",
+	"buffer-drain-max",
+	"buffer-backend",
+	"buffer-compress",
+	"buffer-max-rows",
+	"buffer-max-bytes",
+	"buffer-evict",
+	"buffer-downsample",
+	"buffer-durability",
+	"buffer-hot-rows",
+	"log-level",
 	NULL
 };
 
@@ -44,11 +64,38 @@ static void config_debug(void)
 	debug(DEBUG_INFO, "ucast=%s:%i mcast=%s:%i mcast-group-addr=%s bcast=%s:%i",
 	      config.ucast_addr, config.ucast_port, config.mcast_addr, config.mcast_port, 
 	      config.mcast_gaddr, config.bcast_addr, config.bcast_port);
-	debug(DEBUG_INFO, "packet-validation=%s", config.packet_validation ? "yes" : "no");
+	debug(DEBUG_INFO, "ucast-workers=%i ucast-cpu-pin=%s",
+	      config.ucast_workers, config.ucast_cpu_pin ? "yes" : "no");
+	debug(DEBUG_INFO, "packet-validation=%s recv-batch=%i event-loop=%s io-backend=%s",
+	      config.packet_validation ? "yes" : "no", config.recv_batch,
+	      config.event_loop == CONFIG_LOOP_EPOLL ? "epoll" : "threads",
+	      config.io_backend == CONFIG_IO_URING ? "uring" : "socket");
+	debug(DEBUG_INFO, "recv-timestamp=%s",
+	      config.recv_timestamp == CONFIG_TSTAMP_HARDWARE ? "hardware" :
+	      config.recv_timestamp == CONFIG_TSTAMP_SOFTWARE ? "software" : "none");
 	debug(DEBUG_INFO, "gpsd-addr=%s gpsd-port=%i", config.gpsd_addr, config.gpsd_port);
 	debug(DEBUG_INFO, "db-addr=%s db-port=%i db-name=%s db-user=%s db-passwd=%s",
 	      config.db_addr, config.db_port, config.db_name, config.db_user, config.db_passwd);
-	debug(DEBUG_INFO, "buffer-file=%s buffer-interval=%i", config.buffer_file, config.buffer_interval);
+	debug(DEBUG_INFO, "db-retry-max=%i db-upload=%s", config.db_retry_max,
+	      config.db_upload == CONFIG_UPLOAD_COPY ? "copy" :
+	      config.db_upload == CONFIG_UPLOAD_PIPELINE ? "pipeline" : "insert");
+	debug(DEBUG_INFO, "buffer-file=%s buffer-interval=%i buffer-backend=%s buffer-compress=%s",
+	      config.buffer_file, config.buffer_interval,
+	      config.buffer_backend == CONFIG_BUFFER_LOG ? "log" : "sqlite",
+	      config.buffer_compress ? "yes" : "no");
+	debug(DEBUG_INFO, "buffer-commit-rows=%i buffer-commit-ms=%i buffer-drain-max=%i buffer-durability=%s",
+	      config.buffer_commit_rows, config.buffer_commit_ms, config.buffer_drain_max,
+	      config.buffer_durability == CONFIG_DURABILITY_STRICT ? "strict" :
+	      config.buffer_durability == CONFIG_DURABILITY_RELAXED ? "relaxed" : "normal");
+	debug(DEBUG_INFO, "buffer-max-rows=%i buffer-max-bytes=%lli buffer-evict=%s buffer-downsample=%i",
+	      config.buffer_max_rows, config.buffer_max_bytes,
+	      config.buffer_evict == CONFIG_EVICT_NEWEST ? "drop-newest" :
+	      config.buffer_evict == CONFIG_EVICT_DOWNSAMPLE ? "downsample-oldest" : "drop-oldest",
+	      config.buffer_downsample);
+	debug(DEBUG_INFO, "buffer-hot-rows=%i", config.buffer_hot_rows);
+	debug(DEBUG_INFO, "log-level=%s",
+	      config.log_level == DEBUG_ERROR ? "error" :
+	      config.log_level == DEBUG_WARNING ? "warning" : "info");
 }
 
 const char *config_get_value(char *line)
@@ -139,6 +186,130 @@ static void config_set_value(const char *value, int id)
 			if (config.buffer_interval <= 0)
 				config.buffer_interval = 10;
 			break;
+		case 18: /* recv-batch */
+			config.recv_batch = atoi(value);
+			if (config.recv_batch <= 0)
+				config.recv_batch = 1;
+			else if (config.recv_batch > CONFIG_RECV_BATCH_MAX)
+				config.recv_batch = CONFIG_RECV_BATCH_MAX;
+			break;
+		case 19: /* event-loop */
+			if (!strcmp(value, "epoll"))
+				config.event_loop = CONFIG_LOOP_EPOLL;
+			else
+				config.event_loop = CONFIG_LOOP_THREADS;
+			break;
+		case 20: /* ucast-workers */
+			config.ucast_workers = atoi(value);
+			if (config.ucast_workers <= 0)
+				config.ucast_workers = 1;
+			else if (config.ucast_workers > CONFIG_UCAST_WORKERS_MAX)
+				config.ucast_workers = CONFIG_UCAST_WORKERS_MAX;
+			break;
+		case 21: /* ucast-cpu-pin */
+			if (!strcmp(value, "yes"))
+				config.ucast_cpu_pin = 1;
+			else
+				config.ucast_cpu_pin = 0;
+			break;
+		case 22: /* io-backend */
+			if (!strcmp(value, "uring"))
+				config.io_backend = CONFIG_IO_URING;
+			else
+				config.io_backend = CONFIG_IO_SOCKET;
+			break;
+		case 23: /* recv-timestamp */
+			if (!strcmp(value, "hardware"))
+				config.recv_timestamp = CONFIG_TSTAMP_HARDWARE;
+			else if (!strcmp(value, "software"))
+				config.recv_timestamp = CONFIG_TSTAMP_SOFTWARE;
+			else
+				config.recv_timestamp = CONFIG_TSTAMP_NONE;
+			break;
+		case 24: /* buffer-commit-rows */
+			config.buffer_commit_rows = atoi(value);
+			if (config.buffer_commit_rows <= 0)
+				config.buffer_commit_rows = 100;
+			break;
+		case 25: /* buffer-commit-ms */
+			config.buffer_commit_ms = atoi(value);
+			if (config.buffer_commit_ms < 0)
+				config.buffer_commit_ms = 100;
+			break;
+		case 26: /* db-retry-max */
+			config.db_retry_max = atoi(value);
+			if (config.db_retry_max <= 0)
+				config.db_retry_max = 300;
+			break;
+		case 27: /* db-upload */
+			if (!strcmp(value, "insert"))
+				config.db_upload = CONFIG_UPLOAD_INSERT;
+			else if (!strcmp(value, "pipeline"))
+				config.db_upload = CONFIG_UPLOAD_PIPELINE;
+			else
+				config.db_upload = CONFIG_UPLOAD_COPY;
+			break;
+		case 28: /* buffer-drain-max */
+			config.buffer_drain_max = atoi(value);
+			if (config.buffer_drain_max < 100)
+				config.buffer_drain_max = 100;
+			break;
+		case 29: /* buffer-backend */
+			if (!strcmp(value, "log"))
+				config.buffer_backend = CONFIG_BUFFER_LOG;
+			else
+				config.buffer_backend = CONFIG_BUFFER_SQLITE;
+			break;
+		case 30: /* buffer-compress */
+			if (!strcmp(value, "yes"))
+				config.buffer_compress = 1;
+			else
+				config.buffer_compress = 0;
+			break;
+		case 31: /* buffer-max-rows */
+			config.buffer_max_rows = atoi(value);
+			if (config.buffer_max_rows < 0)
+				config.buffer_max_rows = 0;
+			break;
+		case 32: /* buffer-max-bytes */
+			config.buffer_max_bytes = atoll(value);
+			if (config.buffer_max_bytes < 0)
+				config.buffer_max_bytes = 0;
+			break;
+		case 33: /* buffer-evict */
+			if (!strcmp(value, "drop-newest"))
+				config.buffer_evict = CONFIG_EVICT_NEWEST;
+			else if (!strcmp(value, "downsample-oldest"))
+				config.buffer_evict = CONFIG_EVICT_DOWNSAMPLE;
+			else
+				config.buffer_evict = CONFIG_EVICT_OLDEST;
+			break;
+		case 34: /* buffer-downsample */
+			config.buffer_downsample = atoi(value);
+			if (config.buffer_downsample < 2)
+				config.buffer_downsample = 2;
+			break;
+		case 35: /* buffer-durability */
+			if (!strcmp(value, "strict"))
+				config.buffer_durability = CONFIG_DURABILITY_STRICT;
+			else if (!strcmp(value, "relaxed"))
+				config.buffer_durability = CONFIG_DURABILITY_RELAXED;
+			else
+				config.buffer_durability = CONFIG_DURABILITY_NORMAL;
+			break;
+		case 36: /* buffer-hot-rows */
+			config.buffer_hot_rows = atoi(value);
+			if (config.buffer_hot_rows < 0)
+				config.buffer_hot_rows = 0;
+			break;
+		case 37: /* log-level */
+			if (!strcmp(value, "error"))
+				config.log_level = DEBUG_ERROR;
+			else if (!strcmp(value, "warning"))
+				config.log_level = DEBUG_WARNING;
+			else
+				config.log_level = DEBUG_INFO;
+			break;
 	}
 }
 
@@ -154,6 +325,12 @@ static void config_default(void)
 	sprintf(config.bcast_addr, "%s", "0.0.0.0");
         config.bcast_port = 6002;
 	config.packet_validation = 1;
+	config.recv_batch = 1;
+	config.event_loop = CONFIG_LOOP_THREADS;
+	config.ucast_workers = 1;
+	config.ucast_cpu_pin = 0;
+	config.io_backend = CONFIG_IO_SOCKET;
+	config.recv_timestamp = CONFIG_TSTAMP_SOFTWARE;
 
 	/* GPSD */
 	sprintf(config.gpsd_addr, "%s", "127.0.0.1");
@@ -165,10 +342,26 @@ static void config_default(void)
         sprintf(config.db_name, "%s", "db-name");
         sprintf(config.db_user, "%s", "db-user");
         sprintf(config.db_passwd, "%s", "db-passwd");
+	config.db_retry_max = 300;
+	config.db_upload = CONFIG_UPLOAD_COPY;
 
 	/* Buffer */
 	sprintf(config.buffer_file, "%s", "/tmp/gpsclient.db");
 	config.buffer_interval = 10;
+	config.buffer_commit_rows = 100;
+	config.buffer_commit_ms = 100;
+	config.buffer_drain_max = 10000;
+	config.buffer_backend = CONFIG_BUFFER_SQLITE;
+	config.buffer_compress = 0;
+	config.buffer_max_rows = 0;
+	config.buffer_max_bytes = 0;
+	config.buffer_evict = CONFIG_EVICT_OLDEST;
+	config.buffer_downsample = 10;
+	config.buffer_durability = CONFIG_DURABILITY_NORMAL;
+	config.buffer_hot_rows = 0;
+
+	/* Log */
+	config.log_level = DEBUG_INFO;
 }
 
 int config_read(const char *file)
@@ -8,16 +8,60 @@
 #define CONFIG_MCAST  2
 #define CONFIG_BCAST  3
 
+/* event-loop values */
+#define CONFIG_LOOP_THREADS 0
+#define CONFIG_LOOP_EPOLL   1
+
+/* io-backend values */
+#define CONFIG_IO_SOCKET 0
+#define CONFIG_IO_URING  1
+
+/* recv-timestamp values */
+#define CONFIG_TSTAMP_NONE     0
+#define CONFIG_TSTAMP_SOFTWARE 1
+#define CONFIG_TSTAMP_HARDWARE 2
+
+/* db-upload values */
+#define CONFIG_UPLOAD_INSERT   0
+#define CONFIG_UPLOAD_COPY     1
+#define CONFIG_UPLOAD_PIPELINE 2
+
+/* buffer-backend values */
+#define CONFIG_BUFFER_SQLITE 0
+#define CONFIG_BUFFER_LOG    1
+
+/* buffer-durability values */
+#define CONFIG_DURABILITY_STRICT  0
+#define CONFIG_DURABILITY_NORMAL  1
+#define CONFIG_DURABILITY_RELAXED 2
+
+/* buffer-evict values */
+#define CONFIG_EVICT_OLDEST     0
+#define CONFIG_EVICT_NEWEST     1
+#define CONFIG_EVICT_DOWNSAMPLE 2
+
+/* Upper bound of recv-batch */
+#define CONFIG_RECV_BATCH_MAX 64
+
+/* Upper bound of ucast-workers */
+#define CONFIG_UCAST_WORKERS_MAX 16
+
 struct config {
 	char client_name[16];
 	char ucast_addr[INET_ADDRSTRLEN];
 	unsigned short ucast_port;
+	int ucast_workers;
+	int ucast_cpu_pin;
 	char mcast_addr[INET_ADDRSTRLEN];
 	unsigned short mcast_port;
 	char mcast_gaddr[INET_ADDRSTRLEN];
 	char bcast_addr[INET_ADDRSTRLEN];
 	unsigned short bcast_port;
 	int packet_validation;
+	int recv_batch;
+	int event_loop;
+	int io_backend;
+	int recv_timestamp;
 	char gpsd_addr[INET_ADDRSTRLEN];
 	unsigned short gpsd_port;
 	char db_addr[INET_ADDRSTRLEN];
@@ -25,8 +69,22 @@ struct config {
 	char db_name[16];
 	char db_user[16];
 	char db_passwd[16];
+	int db_retry_max;
+	int db_upload;
 	char buffer_file[256];
 	int buffer_interval;
+	int buffer_commit_rows;
+	int buffer_commit_ms;
+	int buffer_drain_max;
+	int buffer_backend;
+	int buffer_compress;
+	int buffer_max_rows;
+	long long buffer_max_bytes;
+	int buffer_evict;
+	int buffer_downsample;
+	int buffer_durability;
+	int buffer_hot_rows;
+	int log_level;
 };
 
 /* Globally accessed configuration */
@@ -1,13 +1,40 @@
 /*
  * Standard CRC-16 implementation
+ *
+ * Reflected polynomial 0xA001. The nibble kernel is the original one and
+ * serves as reference, crc16_init() builds the tables of the faster ones,
+ * checks them against it and selects the fastest the cpu runs that agrees.
  */
+#include <stddef.h>
+#include <stdint.h>
+#include "crc16.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define CRC16_CLMUL "pclmul"
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+#define CRC16_CLMUL "pmull"
+#endif
 
 static unsigned short crc_16_table[16] = {
 	0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
-	0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400 
+	0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
 };
 
-unsigned short crc16(unsigned short start, char *p, unsigned int len)
+/* crc_slice[0] is the byte table, crc_slice[k] advances k more zero bytes */
+static unsigned short crc_slice[8][256];
+
+/* Carry-less multiply fold constants over 512 and 128 bits, see below */
+static uint64_t crc_fold4[2], crc_fold1[2];
+
+static unsigned short crc16_nibble(unsigned short start,
+				   const unsigned char *p,
+				   unsigned int len)
 {
 	unsigned short crc = start;
 	int r;
@@ -27,3 +54,287 @@ unsigned short crc16(unsigned short start, char *p, unsigned int len)
 	}
 	return crc;
 }
+
+static unsigned short crc16_byte(unsigned short start,
+				 const unsigned char *p,
+				 unsigned int len)
+{
+	unsigned short crc = start;
+
+	while (len--)
+		crc = (crc >> 8) ^ crc_slice[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+/* Eight bytes per step with independent lookups */
+static inline unsigned short crc16_step8(unsigned short crc,
+					 const unsigned char *p)
+{
+	crc ^= p[0] | p[1] << 8;
+	return crc_slice[7][crc & 0xFF] ^ crc_slice[6][crc >> 8] ^
+	       crc_slice[5][p[2]] ^ crc_slice[4][p[3]] ^
+	       crc_slice[3][p[4]] ^ crc_slice[2][p[5]] ^
+	       crc_slice[1][p[6]] ^ crc_slice[0][p[7]];
+}
+
+static unsigned short crc16_slice8(unsigned short start,
+				   const unsigned char *p,
+				   unsigned int len)
+{
+	unsigned short crc = start;
+
+	for (; len >= 8; len -= 8, p += 8)
+		crc = crc16_step8(crc, p);
+	return crc16_byte(crc, p, len);
+}
+
+/* Four buffers of the same length, their lookups overlap */
+static void crc16_slice8_x4(unsigned short *crc,
+			    const unsigned char * const *p,
+			    unsigned int len)
+{
+	unsigned short c0 = crc[0], c1 = crc[1], c2 = crc[2], c3 = crc[3];
+	unsigned int off;
+
+	for (off = 0; off + 8 <= len; off += 8) {
+		c0 = crc16_step8(c0, p[0] + off);
+		c1 = crc16_step8(c1, p[1] + off);
+		c2 = crc16_step8(c2, p[2] + off);
+		c3 = crc16_step8(c3, p[3] + off);
+	}
+	crc[0] = crc16_byte(c0, p[0] + off, len - off);
+	crc[1] = crc16_byte(c1, p[1] + off, len - off);
+	crc[2] = crc16_byte(c2, p[2] + off, len - off);
+	crc[3] = crc16_byte(c3, p[3] + off, len - off);
+}
+
+/*
+ * Carry-less multiply kernels fold the message 16 bytes at a time. The
+ * bytes of a block, loaded little endian, are the coefficients of x^127
+ * down to x^0. A block D bits ahead of the rest of the message is worth
+ *
+ *	Q0(x) x^(D+64) + Q1(x) x^D
+ *
+ * with Q0, Q1 its low and high 64 bits, which modulo P is the product of
+ * each half with a 16 bit constant. The product of two 64 bit reflected
+ * operands comes out one bit short, hence x^(D+63) and x^(D-1). It lands
+ * in the low 80 bits of the next block, which it is added to. The last
+ * block and the tail are finished with the tables, a start value is
+ * added to the first two bytes like the table kernels do.
+ */
+#if defined(CRC16_CLMUL) && !defined(__aarch64__)
+__attribute__((target("pclmul,sse2")))
+static __m128i crc16_fold(__m128i x,
+			  __m128i k,
+			  __m128i next)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					   _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+__attribute__((target("pclmul,sse2")))
+static unsigned short crc16_clmul(unsigned short start,
+				  const unsigned char *p,
+				  unsigned int len)
+{
+	const __m128i *q = (const __m128i *) p;
+	__m128i x0, x1, x2, x3, k;
+	unsigned char buf[16];
+
+	if (len < 64)
+		return crc16_slice8(start, p, len);
+
+	x0 = _mm_xor_si128(_mm_loadu_si128(q), _mm_cvtsi32_si128(start));
+	x1 = _mm_loadu_si128(q + 1);
+	x2 = _mm_loadu_si128(q + 2);
+	x3 = _mm_loadu_si128(q + 3);
+	k = _mm_set_epi64x(crc_fold4[1], crc_fold4[0]);
+	for (q += 4, len -= 64; len >= 64; q += 4, len -= 64) {
+		x0 = crc16_fold(x0, k, _mm_loadu_si128(q));
+		x1 = crc16_fold(x1, k, _mm_loadu_si128(q + 1));
+		x2 = crc16_fold(x2, k, _mm_loadu_si128(q + 2));
+		x3 = crc16_fold(x3, k, _mm_loadu_si128(q + 3));
+	}
+
+	k = _mm_set_epi64x(crc_fold1[1], crc_fold1[0]);
+	x1 = crc16_fold(x0, k, x1);
+	x2 = crc16_fold(x1, k, x2);
+	x3 = crc16_fold(x2, k, x3);
+	for (; len >= 16; q++, len -= 16)
+		x3 = crc16_fold(x3, k, _mm_loadu_si128(q));
+
+	_mm_storeu_si128((__m128i *) buf, x3);
+	return crc16_byte(crc16_slice8(0, buf, 16), (const unsigned char *) q, len);
+}
+
+static int crc16_clmul_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_PCLMUL) && (edx & bit_SSE2);
+}
+#elif defined(CRC16_CLMUL)
+__attribute__((target("+crypto")))
+static uint64x2_t crc16_fold(uint64x2_t x,
+			     const uint64_t *k,
+			     uint64x2_t next)
+{
+	poly128_t lo = vmull_p64((poly64_t) vgetq_lane_u64(x, 0), (poly64_t) k[0]);
+	poly128_t hi = vmull_p64((poly64_t) vgetq_lane_u64(x, 1), (poly64_t) k[1]);
+
+	return veorq_u64(veorq_u64(vreinterpretq_u64_p128(lo),
+				   vreinterpretq_u64_p128(hi)), next);
+}
+
+__attribute__((target("+crypto")))
+static unsigned short crc16_clmul(unsigned short start,
+				  const unsigned char *p,
+				  unsigned int len)
+{
+	uint64x2_t x0, x1, x2, x3;
+	unsigned char buf[16];
+
+	if (len < 64)
+		return crc16_slice8(start, p, len);
+
+	x0 = veorq_u64(vreinterpretq_u64_u8(vld1q_u8(p)),
+		       vsetq_lane_u64(start, vdupq_n_u64(0), 0));
+	x1 = vreinterpretq_u64_u8(vld1q_u8(p + 16));
+	x2 = vreinterpretq_u64_u8(vld1q_u8(p + 32));
+	x3 = vreinterpretq_u64_u8(vld1q_u8(p + 48));
+	for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+		x0 = crc16_fold(x0, crc_fold4, vreinterpretq_u64_u8(vld1q_u8(p)));
+		x1 = crc16_fold(x1, crc_fold4, vreinterpretq_u64_u8(vld1q_u8(p + 16)));
+		x2 = crc16_fold(x2, crc_fold4, vreinterpretq_u64_u8(vld1q_u8(p + 32)));
+		x3 = crc16_fold(x3, crc_fold4, vreinterpretq_u64_u8(vld1q_u8(p + 48)));
+	}
+
+	x1 = crc16_fold(x0, crc_fold1, x1);
+	x2 = crc16_fold(x1, crc_fold1, x2);
+	x3 = crc16_fold(x2, crc_fold1, x3);
+	for (; len >= 16; p += 16, len -= 16)
+		x3 = crc16_fold(x3, crc_fold1, vreinterpretq_u64_u8(vld1q_u8(p)));
+
+	vst1q_u8(buf, vreinterpretq_u8_u64(x3));
+	return crc16_byte(crc16_slice8(0, buf, 16), p, len);
+}
+
+static int crc16_clmul_supported(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_PMULL);
+}
+#endif /* CRC16_CLMUL */
+
+const struct crc16_kernel crc16_kernels[] = {
+	{ "nibble", crc16_nibble, NULL },
+	{ "byte", crc16_byte, NULL },
+	{ "slice8", crc16_slice8, NULL },
+#ifdef CRC16_CLMUL
+	{ CRC16_CLMUL, crc16_clmul, crc16_clmul_supported },
+#endif
+};
+
+const int crc16_nkernels = sizeof(crc16_kernels) / sizeof(crc16_kernels[0]);
+
+static crc16_fn kernel = crc16_nibble;
+
+/* x^n modulo P, reflected into the top of a 64 bit operand */
+static uint64_t crc16_xpow(int n)
+{
+	unsigned int r = 1;
+	uint64_t k = 0;
+	int d;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x18005;
+	}
+	for (d = 0; d < 16; d++)
+		if (r >> d & 1)
+			k |= (uint64_t) 1 << (63 - d);
+	return k;
+}
+
+static void crc16_tables(void)
+{
+	unsigned short crc;
+	unsigned char b;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		b = i;
+		crc_slice[0][i] = crc16_nibble(0, &b, 1);
+	}
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++) {
+			crc = crc_slice[k - 1][i];
+			crc_slice[k][i] = (crc >> 8) ^ crc_slice[0][crc & 0xFF];
+		}
+
+	crc_fold4[0] = crc16_xpow(512 + 63);
+	crc_fold4[1] = crc16_xpow(512 - 1);
+	crc_fold1[0] = crc16_xpow(128 + 63);
+	crc_fold1[1] = crc16_xpow(128 - 1);
+}
+
+/* Lengths and offsets cover the tails and misalignments of every kernel */
+static int crc16_check(crc16_fn fn)
+{
+	unsigned char buf[1100];
+	unsigned int i, len, off;
+	unsigned long x = 1;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+		buf[i] = x >> 56;
+	}
+	for (len = 0; len <= 1024; len += len < 40 ? 1 : 61)
+		for (off = 0; off < 16; off += 5)
+			if (fn(len ^ off, buf + off, len) !=
+			    crc16_nibble(len ^ off, buf + off, len))
+				return 0;
+	return 1;
+}
+
+/* Returns the name of the kernel selected for crc16() */
+const char *crc16_init(void)
+{
+	int i, best = 0;
+
+	crc16_tables();
+	for (i = 1; i < crc16_nkernels; i++) {
+		if (crc16_kernels[i].supported && !crc16_kernels[i].supported())
+			continue;
+		if (crc16_check(crc16_kernels[i].fn))
+			best = i;
+	}
+	kernel = crc16_kernels[best].fn;
+	return crc16_kernels[best].name;
+}
+
+unsigned short crc16(unsigned short start, char *p, unsigned int len)
+{
+	return kernel(start, (const unsigned char *) p, len);
+}
+
+/*
+ * crc16() of n buffers of len bytes, crc holds the start values and
+ * receives the results. The table kernel is run on four buffers at once,
+ * the carry-less multiply one already keeps four folds in flight.
+ */
+void crc16_many(unsigned short *crc,
+		const unsigned char * const *p,
+		unsigned int len,
+		int n)
+{
+	int i = 0;
+
+	if (kernel == crc16_slice8)
+		for (; i + 4 <= n; i += 4)
+			crc16_slice8_x4(&crc[i], &p[i], len);
+	for (; i < n; i++)
+		crc[i] = kernel(crc[i], p[i], len);
+}
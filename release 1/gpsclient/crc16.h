@@ -5,6 +5,27 @@
 #ifndef _CRC16_H_
 #define _CRC16_H_
 
+typedef unsigned short (*crc16_fn)(unsigned short start,
+				   const unsigned char *p,
+				   unsigned int len);
+
+/* Kernels from slowest to fastest, the first is the reference */
+struct crc16_kernel {
+	const char *name;
+	crc16_fn fn;
+	int (*supported)(void);	/* NULL when any cpu runs it */
+};
+
+extern const struct crc16_kernel crc16_kernels[];
+extern const int crc16_nkernels;
+
+const char *crc16_init(void);
+
 unsigned short crc16(unsigned short start, char *p, unsigned int len);
 
+void crc16_many(unsigned short *crc,
+		const unsigned char * const *p,
+		unsigned int len,
+		int n);
+
 #endif /* _CRC16_H_ */
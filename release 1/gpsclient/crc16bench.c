@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "crc16.h"
+#include "msg.h"
+
+/* Checksummed part of a tgr_msg, the crc covers everything after it */
+#define BENCH_LEN (sizeof(struct tgr_msg) - 4)
+#define BENCH_MSGS 64
+
+int main(int argc, char **argv)
+{
+	static unsigned char buf[BENCH_MSGS][BENCH_LEN];
+	struct timespec t0, t1;
+	unsigned short crc, ref[BENCH_MSGS];
+	unsigned long i, n;
+	const char *name;
+	double sec;
+	int k, bad;
+
+	n = argc > 1 ? atol(argv[1]) : 1000000;
+	srand(1);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i / BENCH_LEN][i % BENCH_LEN] = rand();
+
+	name = crc16_init();
+	printf("selected kernel: %s\n", name);
+	for (i = 0; i < BENCH_MSGS; i++)
+		ref[i] = crc16_kernels[0].fn(0, buf[i], BENCH_LEN);
+
+	for (k = 0; k < crc16_nkernels; k++) {
+		if (crc16_kernels[k].supported && !crc16_kernels[k].supported()) {
+			printf("%-8s unsupported\n", crc16_kernels[k].name);
+			continue;
+		}
+		for (bad = 0, i = 0; i < BENCH_MSGS; i++)
+			bad += crc16_kernels[k].fn(0, buf[i], BENCH_LEN) != ref[i];
+
+		crc = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < n; i++)
+			crc ^= crc16_kernels[k].fn(crc & 1, buf[i % BENCH_MSGS], BENCH_LEN);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		sec = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+		printf("%-8s %8.3f GB/s %8.1f ns/msg %s\n", crc16_kernels[k].name,
+		       n * (double) BENCH_LEN / sec / 1e9, sec * 1e9 / n,
+		       bad ? "MISMATCH" : "ok");
+	}
+	return 0;
+}
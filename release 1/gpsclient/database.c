@@ -1,32 +1,144 @@
 #include <libpq-fe.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 #include "utils.h"
 #include "database.h"
 #include "config.h"
 
 typedef PGconn dbctx_t;
 
+/* Name of the prepared insert */
+#define DB_INSERT_STMT "gpsclient_insert"
+#define FLOAT8OID 701
+
+/* Connections open at once, the buffer drain and the hot tier uploader */
+#define DB_CONN_MAX 4
+
+/* Milliseconds unacknowledged data may wait before the connection fails */
+#define DB_USER_TIMEOUT 30000
+
+static struct db_stats stats;
+static dbctx_t *prepared[DB_CONN_MAX];	/* connections the insert is prepared on */
+static pthread_mutex_t dblock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Forget ctx as prepared, it is a new session or going away */
+static void db_forget(dbctx_t *ctx)
+{
+	int i;
+
+	pthread_mutex_lock(&dblock);
+	for (i = 0; i < DB_CONN_MAX; i++)
+		if (prepared[i] == ctx)
+			prepared[i] = NULL;
+	pthread_mutex_unlock(&dblock);
+}
+
+static void db_connected(dbctx_t *ctx)
+{
+	db_forget(ctx);
+	pthread_mutex_lock(&dblock);
+	stats.connected = time(NULL);
+	stats.connects++;
+	if (stats.connects > 1)
+		debug(DEBUG_INFO, "database reconnected connects=%u failures=%u",
+		      stats.connects, stats.failures);
+	pthread_mutex_unlock(&dblock);
+}
+
+static void db_failed(void)
+{
+	pthread_mutex_lock(&dblock);
+	stats.failures++;
+	pthread_mutex_unlock(&dblock);
+}
+
+void db_record_unpack(const struct db_record *rec,
+		      struct db_data *data)
+{
+	struct in_addr addr;
+	const char *client_ip = "";
+
+	if (rec->packet_type == CONFIG_UCAST)
+		client_ip = config.ucast_addr;
+	else if (rec->packet_type == CONFIG_MCAST)
+		client_ip = config.mcast_addr;
+	else if (rec->packet_type == CONFIG_BCAST)
+		client_ip = config.bcast_addr;
+
+	snprintf(data->client_name, sizeof(data->client_name), "%s", config.client_name);
+	snprintf(data->client_ip, sizeof(data->client_ip), "%s", client_ip);
+	if (rec->sender_ip) {
+		addr.s_addr = rec->sender_ip;
+		inet_ntop(AF_INET, &addr, data->sender_ip, sizeof(data->sender_ip));
+	} else
+		memset(data->sender_ip, 0, sizeof(data->sender_ip));
+	data->gps_tsp = rec->gps_tsp;
+	data->recv_tsp = rec->recv_tsp;
+	data->gps_lat = rec->gps_lat;
+	data->gps_lon = rec->gps_lon;
+	data->packet_type = rec->packet_type;
+}
+
 dbctx_t *db_connect(void)
 {
 	dbctx_t *ctx;
-	char conn_str[128];
+	char conn_str[256];
 
+	/*
+	 * Keepalives and tcp_user_timeout bound a call on a link that went
+	 * silent, so an upload fails instead of blocking its thread for good.
+	 */
 	snprintf(conn_str, sizeof(conn_str),
-		 "hostaddr=%s port=%i dbname=%s user=%s password=%s connect_timeout=3",
+		 "hostaddr=%s port=%i dbname=%s user=%s password=%s connect_timeout=3 "
+		 "keepalives=1 keepalives_idle=10 keepalives_interval=5 keepalives_count=3 "
+		 "tcp_user_timeout=%i",
 		 config.db_addr, config.db_port, config.db_name, config.db_user, 
-		 config.db_passwd);
+		 config.db_passwd, DB_USER_TIMEOUT);
 
 	ctx = PQconnectdb(conn_str);
 	if (PQstatus (ctx) != CONNECTION_OK) {
 		debug(DEBUG_ERROR, "could not connect to database: %s", PQerrorMessage (ctx));
 		PQfinish (ctx);
+		db_failed();
 		return NULL;
 	}
+	db_connected(ctx);
 	return ctx;
 }
 
+/*
+ * Health check of a long lived connection. A connection that went bad is
+ * reset in place. Returns 1 if ctx can be used.
+ */
+int db_check(dbctx_t *ctx)
+{
+	if (PQstatus(ctx) == CONNECTION_OK)
+		return 1;
+
+	PQreset(ctx);
+	if (PQstatus(ctx) != CONNECTION_OK) {
+		debug(DEBUG_ERROR, "could not reset database connection: %s", PQerrorMessage(ctx));
+		db_failed();
+		return 0;
+	}
+	db_connected(ctx);
+	return 1;
+}
+
+void db_get_stats(struct db_stats *st)
+{
+	pthread_mutex_lock(&dblock);
+	memcpy(st, &stats, sizeof(struct db_stats));
+	pthread_mutex_unlock(&dblock);
+}
+
 void db_close(dbctx_t *ctx)
 {
+	db_forget(ctx);
 	PQfinish(ctx);
 }
 
@@ -38,10 +150,10 @@ int db_insert(dbctx_t *ctx,
 	char cmd[1024];
 
 	snprintf(cmd, sizeof(cmd),
-		 "insert into gpsclient(client_name,client_ip,sender_ip,gps_tsp,gps_latitude,"
-		 "gps_longitude,packet_type) values('%s','%s','%s',%f,%f,%f,%i)", 
-		 data->client_name, data->client_ip, data->sender_ip, data->gps_tsp, 
-		 data->gps_lat,data->gps_lon, data->packet_type);
+		 "insert into gpsclient(client_name,client_ip,sender_ip,gps_tsp,recv_tsp,"
+		 "gps_latitude,gps_longitude,packet_type) values('%s','%s','%s',%.17g,%.17g,%.17g,%.17g,%i)",
+		 data->client_name, data->client_ip, data->sender_ip, data->gps_tsp,
+		 data->recv_tsp, data->gps_lat,data->gps_lon, data->packet_type);
 	result = PQexec (ctx, cmd);
 	if (result == NULL) {
 		debug(DEBUG_ERROR, "%s", PQerrorMessage (ctx));
@@ -56,3 +168,240 @@ int db_insert(dbctx_t *ctx,
 	PQclear (result);
 	return ret;
 }
+
+/* Escape a text field for COPY text format */
+static void copy_escape(char *dst,
+			size_t size,
+			const char *src)
+{
+	size_t n = 0;
+
+	for (; *src && n + 2 < size; src++) {
+		if (*src == '\\' || *src == '\t' || *src == '\n' || *src == '\r') {
+			dst[n++] = '\\';
+			dst[n++] = *src == '\t' ? 't' : *src == '\n' ? 'n' :
+				   *src == '\r' ? 'r' : '\\';
+		} else
+			dst[n++] = *src;
+	}
+	dst[n] = 0;
+}
+
+/*
+ * Upload count records with a single COPY FROM STDIN in text format.
+ * COPY runs as one statement, so either all records are stored or none.
+ */
+int db_copy(dbctx_t *ctx,
+	    const struct db_data *data,
+	    int count)
+{
+	PGresult *result;
+	char chunk[65536];
+	char name[2 * sizeof(data->client_name)];
+	char cip[2 * sizeof(data->client_ip)];
+	char sip[2 * sizeof(data->sender_ip)];
+	int i, len = 0, ret = 1;
+
+	result = PQexec(ctx, "copy gpsclient(client_name,client_ip,sender_ip,gps_tsp,recv_tsp,"
+			"gps_latitude,gps_longitude,packet_type) from stdin");
+	if (PQresultStatus(result) != PGRES_COPY_IN) {
+		debug(DEBUG_ERROR, "could not start copy: %s", PQerrorMessage(ctx));
+		PQclear(result);
+		return 0;
+	}
+	PQclear(result);
+
+	for (i = 0; i < count && ret; i++) {
+		copy_escape(name, sizeof(name), data[i].client_name);
+		copy_escape(cip, sizeof(cip), data[i].client_ip);
+		copy_escape(sip, sizeof(sip), data[i].sender_ip);
+		len += snprintf(chunk + len, sizeof(chunk) - len,
+				"%s\t%s\t%s\t%.17g\t%.17g\t%.17g\t%.17g\t%i\n",
+				name, cip, sip, data[i].gps_tsp, data[i].recv_tsp,
+				data[i].gps_lat, data[i].gps_lon, data[i].packet_type);
+		/* Flush before the next row could overflow the chunk */
+		if (len > sizeof(chunk) - 512 || i == count - 1) {
+			if (PQputCopyData(ctx, chunk, len) != 1)
+				ret = 0;
+			len = 0;
+		}
+	}
+
+	if (PQputCopyEnd(ctx, ret ? NULL : "upload aborted") != 1) {
+		debug(DEBUG_ERROR, "could not end copy: %s", PQerrorMessage(ctx));
+		ret = 0;
+	}
+
+	while ((result = PQgetResult(ctx))) {
+		if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+			debug(DEBUG_ERROR, "could not copy to db: %s", PQresultErrorMessage(result));
+			ret = 0;
+		}
+		PQclear(result);
+	}
+	return ret;
+}
+
+/* Prepare the insert once per connection, again after a reset */
+static int db_prepare(dbctx_t *ctx)
+{
+	PGresult *result;
+	Oid types[8] = { 0, 0, 0, FLOAT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID, 0 };
+	int i, ret;
+
+	pthread_mutex_lock(&dblock);
+	for (i = 0; i < DB_CONN_MAX && prepared[i] != ctx; i++)
+		;
+	pthread_mutex_unlock(&dblock);
+	if (i < DB_CONN_MAX)
+		return 1;
+
+	result = PQprepare(ctx, DB_INSERT_STMT,
+			   "insert into gpsclient(client_name,client_ip,sender_ip,gps_tsp,recv_tsp,"
+			   "gps_latitude,gps_longitude,packet_type) values($1,$2,$3,$4,$5,$6,$7,$8)",
+			   8, types);
+	ret = PQresultStatus(result) == PGRES_COMMAND_OK;
+	if (ret) {
+		pthread_mutex_lock(&dblock);
+		for (i = 0; i < DB_CONN_MAX && prepared[i]; i++)
+			;
+		if (i < DB_CONN_MAX)
+			prepared[i] = ctx;
+		pthread_mutex_unlock(&dblock);
+	} else
+		debug(DEBUG_ERROR, "could not prepare insert: %s", PQresultErrorMessage(result));
+	PQclear(result);
+	return ret;
+}
+
+/* float8 in binary wire format */
+static void db_float8(double v,
+		      uint32_t out[2])
+{
+	uint64_t u;
+
+	memcpy(&u, &v, sizeof(u));
+	out[0] = htonl(u >> 32);
+	out[1] = htonl(u & 0xffffffff);
+}
+
+static int db_send_insert(dbctx_t *ctx,
+			  const struct db_data *data)
+{
+	const char *values[8];
+	int lengths[8] = { 0, 0, 0, 8, 8, 8, 8, 0 };
+	int formats[8] = { 0, 0, 0, 1, 1, 1, 1, 0 };
+	uint32_t f8[4][2];
+	char type[12];
+
+	db_float8(data->gps_tsp, f8[0]);
+	db_float8(data->recv_tsp, f8[1]);
+	db_float8(data->gps_lat, f8[2]);
+	db_float8(data->gps_lon, f8[3]);
+	snprintf(type, sizeof(type), "%i", data->packet_type);
+
+	values[0] = data->client_name;
+	values[1] = data->client_ip;
+	values[2] = data->sender_ip;
+	values[3] = (const char*) f8[0];
+	values[4] = (const char*) f8[1];
+	values[5] = (const char*) f8[2];
+	values[6] = (const char*) f8[3];
+	values[7] = type;
+	return PQsendQueryPrepared(ctx, DB_INSERT_STMT, 8, values, lengths, formats, 0);
+}
+
+/*
+ * Insert count records with the prepared statement and binary parameters.
+ * With libpq pipeline mode all inserts are sent before the first result
+ * is read, so a batch costs one round trip. The whole pipeline runs in one
+ * transaction, either all records are stored or none. It is an explicit
+ * one so that inserts sent before a failed send are rolled back instead of
+ * committed by the sync.
+ */
+int db_insert_batch(dbctx_t *ctx,
+		    const struct db_data *data,
+		    int count)
+{
+	PGresult *result;
+	int i, sent, ret = 1;
+
+	if (!db_prepare(ctx))
+		return 0;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if (!PQenterPipelineMode(ctx)) {
+		debug(DEBUG_ERROR, "could not enter pipeline mode: %s", PQerrorMessage(ctx));
+		return 0;
+	}
+
+	/* begin, the inserts and commit only if every insert went out */
+	sent = 0;
+	if (PQsendQueryParams(ctx, "begin", 0, NULL, NULL, NULL, NULL, 0)) {
+		sent++;
+		for (i = 0; i < count; i++) {
+			if (!db_send_insert(ctx, &data[i]))
+				break;
+			sent++;
+		}
+		if (i == count &&
+		    PQsendQueryParams(ctx, "commit", 0, NULL, NULL, NULL, NULL, 0))
+			sent++;
+	}
+	if (sent < count + 2) {
+		debug(DEBUG_ERROR, "could not send insert: %s", PQerrorMessage(ctx));
+		ret = 0;
+	}
+	if (!PQpipelineSync(ctx))
+		ret = 0;
+
+	/* One result and a NULL per query sent, then the sync */
+	for (i = 0; i < sent; i++) {
+		result = PQgetResult(ctx);
+		if (!result)
+			break;
+		if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+			if (PQresultStatus(result) != PGRES_PIPELINE_ABORTED)
+				debug(DEBUG_ERROR, "could not insert to db: %s",
+				      PQresultErrorMessage(result));
+			ret = 0;
+		}
+		PQclear(result);
+		result = PQgetResult(ctx);
+		if (result)
+			PQclear(result);
+	}
+	while ((result = PQgetResult(ctx))) {
+		if (PQresultStatus(result) == PGRES_PIPELINE_SYNC) {
+			PQclear(result);
+			break;
+		}
+		PQclear(result);
+	}
+	PQexitPipelineMode(ctx);
+
+	/* A failed begin block is left open by the sync */
+	if (!ret && sent)
+		PQclear(PQexec(ctx, "rollback"));
+#else
+	/* Old libpq, one round trip per record inside one transaction */
+	result = PQexec(ctx, "begin");
+	PQclear(result);
+	for (i = 0; i < count && ret; i++) {
+		ret = db_send_insert(ctx, &data[i]);
+		while ((result = PQgetResult(ctx))) {
+			if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+				debug(DEBUG_ERROR, "could not insert to db: %s",
+				      PQresultErrorMessage(result));
+				ret = 0;
+			}
+			PQclear(result);
+		}
+	}
+	result = PQexec(ctx, ret ? "commit" : "rollback");
+	if (PQresultStatus(result) != PGRES_COMMAND_OK)
+		ret = 0;
+	PQclear(result);
+#endif
+	return ret;
+}
@@ -3,6 +3,8 @@
 
 #include <libpq-fe.h>
 #include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
 
 typedef PGconn dbctx_t;
 
@@ -11,16 +13,54 @@ struct db_data {
 	char client_ip[INET_ADDRSTRLEN];     /* client ip address */
 	char sender_ip[INET_ADDRSTRLEN];     /* sender ip address */
 	double gps_tsp;         /* gps timestamp */
+	double recv_tsp;        /* packet arrival timestamp */
 	double gps_lat;         /* gps latitude */
 	double gps_lon;         /* gps longitude */
 	int packet_type;        /* type of packet */
 };
 
+/*
+ * Packed form of db_data kept in the buffer. client_name and client_ip
+ * are the same for every record of a packet type, db_record_unpack()
+ * fills them in from the configuration at upload time.
+ */
+struct db_record {
+	double gps_tsp;         /* gps timestamp */
+	double recv_tsp;        /* packet arrival timestamp */
+	double gps_lat;         /* gps latitude */
+	double gps_lon;         /* gps longitude */
+	uint32_t sender_ip;     /* sender ipv4 address, network order, 0 if none */
+	uint8_t packet_type;    /* type of packet */
+	uint8_t __reserved[3];
+};
+
+/* Connection statistics of the buffer uploader */
+struct db_stats {
+	time_t connected;       /* time of last successful connect or reset */
+	unsigned connects;      /* successful connects and resets */
+	unsigned failures;      /* failed connects and resets */
+};
+
+void db_record_unpack(const struct db_record *rec,
+                      struct db_data *data);
+
 dbctx_t *db_connect(void);
 
+int db_check(dbctx_t *ctx);
+
+void db_get_stats(struct db_stats *stats);
+
 void db_close(dbctx_t *ctx);
 
 int db_insert(dbctx_t *ctx,
               const struct db_data *data);
 
+int db_copy(dbctx_t *ctx,
+            const struct db_data *data,
+            int count);
+
+int db_insert_batch(dbctx_t *ctx,
+                    const struct db_data *data,
+                    int count);
+
 #endif /* _DATABASE_H_ */
@@ -4,7 +4,11 @@ CREATE TABLE gpsclient (
 	client_ip VARCHAR(15),     -- client ip address
 	sender_ip VARCHAR(15),     -- sender ip address
 	gps_tsp FLOAT,             -- gps timestamp
+	recv_tsp FLOAT,            -- packet arrival timestamp
 	gps_latitude FLOAT,        -- gps latitude
 	gps_longitude FLOAT,       -- gps longitude
 	packet_type CHAR           -- type of packet
 );
+
+-- Upgrade of an existing table:
+-- ALTER TABLE gpsclient ADD COLUMN recv_tsp FLOAT;
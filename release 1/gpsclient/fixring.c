@@ -0,0 +1,156 @@
+/*
+ * History of the last FIXRING_SIZE gps fixes. There is a single writer,
+ * the gpsd reader loop, and any number of lock free readers. Each slot is
+ * guarded by its own sequence counter which is odd while the slot is being
+ * written, readers retry a slot whose counter changed under them.
+ *
+ * Each fix also keeps the system time it was pushed at. The smallest lag
+ * of the push after the fix time estimates how far the system clock is
+ * off gps time, taken as it is only when it exceeds FIXRING_SKEW.
+ */
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "fixring.h"
+
+struct fixring_slot {
+	unsigned seq;
+	struct gps_fix_t fix;
+	double local;		/* system time of the push */
+};
+
+static struct fixring_slot ring[FIXRING_SIZE];
+static unsigned ring_head;	/* number of fixes ever pushed */
+static double ring_offset;	/* system time minus gps time */
+
+static void slot_read(const struct fixring_slot *slot,
+		      struct gps_fix_t *fix)
+{
+	unsigned s;
+
+	do {
+		while ((s = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(fix, &slot->fix, sizeof(struct gps_fix_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != s);
+}
+
+/* Called by the gpsd reader only, ignores fixes not newer than the last */
+void fixring_push(const struct gps_fix_t *fix)
+{
+	struct fixring_slot *slot;
+	struct timespec ts;
+	unsigned head, n, i;
+	double offset;
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	if (head && fix->time <= ring[(head - 1) % FIXRING_SIZE].fix.time)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	slot = &ring[head % FIXRING_SIZE];
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->fix, fix, sizeof(struct gps_fix_t));
+	slot->local = ts.tv_sec + ts.tv_nsec / 1e9;
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	head++;
+
+	/* The writer owns the slots, no need to go through slot_read() */
+	n = head < FIXRING_SIZE ? head : FIXRING_SIZE;
+	offset = slot->local - slot->fix.time;
+	for (i = 0; i < n; i++)
+		if (ring[i].local - ring[i].fix.time < offset)
+			offset = ring[i].local - ring[i].fix.time;
+	__atomic_store(&ring_offset, &offset, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring_head, head, __ATOMIC_RELEASE);
+}
+
+static double lon_wrap(double lon)
+{
+	if (lon > 180.0)
+		lon -= 360.0;
+	else if (lon < -180.0)
+		lon += 360.0;
+	return lon;
+}
+
+/*
+ * Dead reckoning from fix to time tsp with its speed and track, limited to
+ * FIXRING_AHEAD seconds. Without speed or track the fix is kept as is.
+ */
+static void extrapolate(struct gps_fix_t *fix,
+			double tsp)
+{
+	double dt, d, lat;
+
+	dt = tsp - fix->time;
+	if (dt > FIXRING_AHEAD)
+		dt = FIXRING_AHEAD;
+	if (isnan(fix->speed) || isnan(fix->track) || dt <= 0)
+		return;
+
+	d = fix->speed * dt / EARTH_RADIUS * 180.0 / M_PI;
+	lat = fix->latitude * M_PI / 180.0;
+	fix->latitude += d * cos(fix->track * M_PI / 180.0);
+	if (cos(lat) > 1e-6)
+		fix->longitude = lon_wrap(fix->longitude +
+					  d * sin(fix->track * M_PI / 180.0) / cos(lat));
+	fix->time = tsp;
+}
+
+/*
+ * Position at system time tsp, linearly interpolated between the two
+ * fixes around it on the gps time axis, tsp is moved onto it first if the
+ * clocks disagree. Triggers usually arrive before gpsd reports the fix
+ * after them, those are extrapolated from the newest fix. Before the
+ * history the oldest fix is returned unchanged. Returns 0 if no fix was
+ * pushed yet.
+ */
+int fixring_lookup(double tsp,
+		   struct gps_fix_t *fix)
+{
+	struct gps_fix_t a, b;
+	unsigned head, n, i;
+	double f, dlon, offset;
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	if (!head)
+		return 0;
+	__atomic_load(&ring_offset, &offset, __ATOMIC_RELAXED);
+	if (fabs(offset) > FIXRING_SKEW)
+		tsp -= offset;
+
+	/* Walk from the newest fix back to the first one not after tsp */
+	n = head < FIXRING_SIZE ? head : FIXRING_SIZE;
+	slot_read(&ring[(head - 1) % FIXRING_SIZE], &b);
+	if (isnan(tsp) || tsp >= b.time) {
+		memcpy(fix, &b, sizeof(struct gps_fix_t));
+		if (!isnan(tsp))
+			extrapolate(fix, tsp);
+		return 1;
+	}
+	for (i = 2; i <= n; i++) {
+		slot_read(&ring[(head - i) % FIXRING_SIZE], &a);
+		if (a.time > b.time)
+			break;	/* overwritten by the writer meanwhile */
+		if (a.time <= tsp)
+			break;
+		b = a;
+	}
+
+	/* b is now the oldest fix still in the ring */
+	if (i > n || a.time > b.time) {
+		memcpy(fix, &b, sizeof(struct gps_fix_t));
+		return 1;
+	}
+
+	f = (b.time > a.time) ? (tsp - a.time) / (b.time - a.time) : 0;
+	memcpy(fix, f < 0.5 ? &a : &b, sizeof(struct gps_fix_t));
+	dlon = lon_wrap(b.longitude - a.longitude);
+	fix->time = tsp;
+	fix->latitude = a.latitude + f * (b.latitude - a.latitude);
+	fix->longitude = lon_wrap(a.longitude + f * dlon);
+	return 1;
+}
@@ -0,0 +1,23 @@
+#ifndef _FIXRING_H_
+#define _FIXRING_H_
+
+#include <gps.h>
+
+/* Number of fixes kept, power of two */
+#define FIXRING_SIZE 16
+
+/* System clock offset from gps time that is corrected, in seconds */
+#define FIXRING_SKEW 1.0
+
+/* Longest extrapolation past the newest fix, in seconds */
+#define FIXRING_AHEAD 2.0
+
+/* Mean earth radius in meters */
+#define EARTH_RADIUS 6371000.0
+
+void fixring_push(const struct gps_fix_t *fix);
+
+int fixring_lookup(double tsp,
+		   struct gps_fix_t *fix);
+
+#endif /* _FIXRING_H_ */
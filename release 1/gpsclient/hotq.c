@@ -0,0 +1,90 @@
+/*
+ * Bounded queue of records between the receive threads and the hot tier
+ * uploader. Any number of producers pushing without locks, and one
+ * consumer at a time. Every slot carries a sequence number: pos when free
+ * for the producer that claims position pos, pos + 1 once the record in
+ * it is complete. The consumer frees a slot for the next lap by setting it
+ * to pos + size.
+ */
+#include <stdlib.h>
+#include "hotq.h"
+
+struct hotq_slot {
+	unsigned long seq;
+	struct db_record rec;
+};
+
+static struct hotq_slot *ring;
+static unsigned long mask;
+static unsigned long head;	/* next position to claim, producers */
+static unsigned long tail;	/* next position to pop, consumer */
+
+/* size is rounded up to a power of two */
+int hotq_init(unsigned size)
+{
+	unsigned long n = 1, i;
+
+	while (n < size)
+		n <<= 1;
+	ring = calloc(n, sizeof(struct hotq_slot));
+	if (!ring)
+		return 0;
+	for (i = 0; i < n; i++)
+		ring[i].seq = i;
+	mask = n - 1;
+	return 1;
+}
+
+/* Returns 0 if the queue is full */
+int hotq_push(const struct db_record *rec)
+{
+	struct hotq_slot *slot;
+	unsigned long pos, seq;
+
+	pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &ring[pos & mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long) (seq - pos) < 0)
+			return 0;
+		else
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	}
+	slot->rec = *rec;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Pops up to max records in claim order. Callers must be serialized, the
+ * buffer does it with hot_lock.
+ */
+int hotq_pop(struct db_record *rec,
+	     int max)
+{
+	struct hotq_slot *slot;
+	unsigned long pos = tail;
+	int n;
+
+	for (n = 0; n < max; n++) {
+		slot = &ring[pos & mask];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+		rec[n] = slot->rec;
+		__atomic_store_n(&slot->seq, pos + mask + 1, __ATOMIC_RELEASE);
+		pos++;
+	}
+	__atomic_store_n(&tail, pos, __ATOMIC_RELAXED);
+	return n;
+}
+
+/* Claimed and not yet popped, a snapshot */
+unsigned hotq_count(void)
+{
+	return __atomic_load_n(&head, __ATOMIC_RELAXED) -
+	       __atomic_load_n(&tail, __ATOMIC_RELAXED);
+}
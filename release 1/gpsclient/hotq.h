@@ -0,0 +1,15 @@
+#ifndef _HOTQ_H_
+#define _HOTQ_H_
+
+#include "database.h"
+
+int hotq_init(unsigned size);
+
+int hotq_push(const struct db_record *rec);
+
+int hotq_pop(struct db_record *rec,
+	     int max);
+
+unsigned hotq_count(void);
+
+#endif /* _HOTQ_H_ */
@@ -0,0 +1,428 @@
+/*
+ * Asynchronous backend of debug(). Each thread logs into a ring of its
+ * own holding binary records: the format string, the raw arguments and a
+ * timestamp, so nothing is formatted by the caller. The log thread merges
+ * the rings by timestamp, formats the records and writes them to stderr.
+ *
+ * The format is kept by pointer and must be a literal. Strings are copied
+ * into the record, truncated to the space left. A record that finds its
+ * ring full is dropped, the count is reported by the log thread.
+ *
+ * Errors return only once written, they are often followed by an exit.
+ * Before log_init() records are written synchronously.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+/* Room for the arguments of a record, a record is 512 bytes */
+#define LOG_ARGS_SIZE 464
+
+/* Log thread sleep while all rings are empty */
+#define LOG_POLL_MS 10
+
+#define LOG_LINE_MAX 2048
+
+struct log_record {
+	struct timespec ts;
+	const char *fmt;
+	const char *file;
+	int line;
+	int level;
+	unsigned len;
+	unsigned char args[LOG_ARGS_SIZE];
+};
+
+struct log_ring {
+	struct log_record rec[LOG_RING_SIZE];
+	unsigned long head;	/* owner thread */
+	unsigned long tail;	/* log thread, once written out */
+	unsigned long dropped;	/* owner thread */
+	unsigned long read;	/* log thread only */
+	unsigned long reported;	/* log thread only */
+	struct log_ring *next;
+};
+
+int log_level = DEBUG_INFO;
+
+static int started;
+static struct log_ring *rings;
+static __thread struct log_ring *own;
+static char outbuf[65536];
+
+/* A conversion specification, parsed from after the % */
+struct log_spec {
+	const char *end;	/* past the conversion character */
+	char conv;
+	char len;		/* h, H for hh, l, q for ll, z, L or 0 */
+	int stars;		/* '*' width and precision */
+};
+
+static int log_spec(const char *p,
+		    struct log_spec *spec)
+{
+	spec->stars = 0;
+	spec->len = 0;
+
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*') {
+		spec->stars++;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->stars++;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	if (*p == 'h' && p[1] == 'h') {
+		spec->len = 'H';
+		p += 2;
+	} else if (*p == 'l' && p[1] == 'l') {
+		spec->len = 'q';
+		p += 2;
+	} else if (*p && strchr("hlqjztL", *p)) {
+		spec->len = *p == 'j' ? 'q' : *p == 't' ? 'z' : *p;
+		p++;
+	}
+
+	if (!*p || !strchr("diouxXcfFeEgGaAsp%", *p))
+		return 0;
+	spec->conv = *p++;
+	spec->end = p;
+	return 1;
+}
+
+static int put(struct log_record *r,
+	       const void *v,
+	       size_t size)
+{
+	if (r->len + size > LOG_ARGS_SIZE)
+		return 0;
+	memcpy(&r->args[r->len], v, size);
+	r->len += size;
+	return 1;
+}
+
+static int get(const struct log_record *r,
+	       unsigned *off,
+	       void *v,
+	       size_t size)
+{
+	if (*off + size > r->len)
+		return 0;
+	memcpy(v, &r->args[*off], size);
+	*off += size;
+	return 1;
+}
+
+#define PUT_ARG(r, ap, type) \
+do { \
+	type __v = va_arg(ap, type); \
+	if (!put(r, &__v, sizeof(__v))) \
+		return; \
+} while (0)
+
+/* Copy the arguments the format consumes, stops when the record is full */
+static void log_pack(struct log_record *r,
+		     va_list ap)
+{
+	struct log_spec spec;
+	const char *p = r->fmt, *s;
+	size_t n;
+	int i;
+
+	while ((p = strchr(p, '%'))) {
+		if (!log_spec(p + 1, &spec))
+			return;
+		p = spec.end;
+		for (i = 0; i < spec.stars; i++)
+			PUT_ARG(r, ap, int);
+
+		switch (spec.conv) {
+		case '%':
+			break;
+		case 's':
+			s = va_arg(ap, const char *);
+			if (!s)
+				s = "(null)";
+			if (r->len >= LOG_ARGS_SIZE)
+				return;
+			n = strnlen(s, LOG_ARGS_SIZE - r->len - 1);
+			memcpy(&r->args[r->len], s, n);
+			r->args[r->len + n] = 0;
+			r->len += n + 1;
+			break;
+		case 'p':
+			PUT_ARG(r, ap, void *);
+			break;
+		case 'f': case 'F': case 'e': case 'E':
+		case 'g': case 'G': case 'a': case 'A':
+			if (spec.len == 'L')
+				PUT_ARG(r, ap, long double);
+			else
+				PUT_ARG(r, ap, double);
+			break;
+		default:
+			if (spec.len == 'l')
+				PUT_ARG(r, ap, long);
+			else if (spec.len == 'q')
+				PUT_ARG(r, ap, long long);
+			else if (spec.len == 'z')
+				PUT_ARG(r, ap, size_t);
+			else
+				PUT_ARG(r, ap, int);
+		}
+	}
+}
+
+#define FORMAT_ARG(r, off, type, out, size, spec) \
+do { \
+	type __v; \
+	if (!get(r, off, &__v, sizeof(__v))) \
+		return -1; \
+	return snprintf(out, size, spec, __v); \
+} while (0)
+
+/*
+ * Format one conversion, the specification is copied with any '*'
+ * replaced by its stored value. Returns -1 once the arguments run out.
+ */
+static int log_conv(const struct log_record *r,
+		    unsigned *off,
+		    const char *p,
+		    const struct log_spec *spec,
+		    char *out,
+		    size_t size)
+{
+	char buf[64];
+	size_t n = 0;
+	int star, ret;
+
+	for (; p < spec->end && n < sizeof(buf) - 12; p++) {
+		if (*p != '*') {
+			buf[n++] = *p;
+			continue;
+		}
+		if (!get(r, off, &star, sizeof(star)))
+			return -1;
+		n += sprintf(&buf[n], "%i", star);
+	}
+	buf[n] = 0;
+
+	switch (spec->conv) {
+	case '%':
+		return snprintf(out, size, "%%");
+	case 's':
+		if (*off >= r->len)
+			return -1;
+		ret = snprintf(out, size, buf, (const char *) &r->args[*off]);
+		*off += strlen((const char *) &r->args[*off]) + 1;
+		return ret;
+	case 'p':
+		FORMAT_ARG(r, off, void *, out, size, buf);
+	case 'f': case 'F': case 'e': case 'E':
+	case 'g': case 'G': case 'a': case 'A':
+		if (spec->len == 'L')
+			FORMAT_ARG(r, off, long double, out, size, buf);
+		FORMAT_ARG(r, off, double, out, size, buf);
+	default:
+		if (spec->len == 'l')
+			FORMAT_ARG(r, off, long, out, size, buf);
+		if (spec->len == 'q')
+			FORMAT_ARG(r, off, long long, out, size, buf);
+		if (spec->len == 'z')
+			FORMAT_ARG(r, off, size_t, out, size, buf);
+		FORMAT_ARG(r, off, int, out, size, buf);
+	}
+}
+
+/* Write one record as debug() always has */
+static void log_emit(const struct log_record *r)
+{
+	const char * const level_str[4] = { "FATL", "ERRR", "WARN", "INFO" };
+	char msg[LOG_LINE_MAX];
+	struct log_spec spec;
+	const char *p = r->fmt, *q;
+	unsigned off = 0;
+	size_t n = 0;
+	int ret;
+	struct tm st;
+
+	while (*p && n < sizeof(msg) - 1) {
+		if (*p != '%' || !log_spec(p + 1, &spec)) {
+			msg[n++] = *p++;
+			continue;
+		}
+		ret = log_conv(r, &off, p, &spec, &msg[n], sizeof(msg) - n);
+		if (ret < 0) {
+			/* Arguments did not fit the record, leave it as is */
+			for (q = p; q < spec.end && n < sizeof(msg) - 1; q++)
+				msg[n++] = *q;
+		} else {
+			n += ret;
+			if (n > sizeof(msg) - 1)
+				n = sizeof(msg) - 1;
+		}
+		p = spec.end;
+	}
+	msg[n] = 0;
+
+	localtime_r(&r->ts.tv_sec, &st);
+	fprintf(stderr, "[%s] %i%.2i%.2i.%.2i%.2i%.2i.%.2i %s [%s:%i]\n",
+		level_str[r->level], (st.tm_year + 1900) % 100, st.tm_mon + 1, st.tm_mday,
+		st.tm_hour, st.tm_min, st.tm_sec, (int) (r->ts.tv_nsec / 10000000), msg,
+		r->file, r->line);
+}
+
+static struct log_ring *log_ring(void)
+{
+	struct log_ring *ring;
+
+	ring = calloc(1, sizeof(struct log_ring));
+	if (!ring)
+		return NULL;
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return ring;
+}
+
+/* Write out every pending record, oldest first, returns how many */
+static int log_drain(void)
+{
+	struct log_ring *ring, *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	struct log_ring *min;
+	struct log_record *r, *m = NULL;
+	struct log_record note;
+	unsigned long dropped;
+	int n = 0;
+
+	while (1) {
+		min = NULL;
+		for (ring = first; ring; ring = ring->next) {
+			if (ring->read == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+				continue;
+			r = &ring->rec[ring->read & (LOG_RING_SIZE - 1)];
+			if (!min || r->ts.tv_sec < m->ts.tv_sec ||
+			    (r->ts.tv_sec == m->ts.tv_sec && r->ts.tv_nsec < m->ts.tv_nsec)) {
+				min = ring;
+				m = r;
+			}
+		}
+		if (!min)
+			break;
+		log_emit(m);
+		min->read++;
+		n++;
+	}
+
+	for (ring = first; ring; ring = ring->next) {
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped == ring->reported)
+			continue;
+		note.fmt = "log ring full, dropped=%lu";
+		note.file = __FILE__;
+		note.line = __LINE__;
+		note.level = DEBUG_WARNING;
+		note.len = 0;
+		clock_gettime(CLOCK_REALTIME, &note.ts);
+		dropped -= ring->reported;
+		put(&note, &dropped, sizeof(dropped));
+		log_emit(&note);
+		ring->reported += dropped;
+	}
+
+	/* Slots are handed back only once written, see log_write() */
+	fflush(stderr);
+	for (ring = first; ring; ring = ring->next)
+		__atomic_store_n(&ring->tail, ring->read, __ATOMIC_RELEASE);
+	return n;
+}
+
+static void *log_routine(void *data)
+{
+	while (1)
+		if (!log_drain())
+			msleep(LOG_POLL_MS);
+
+	/* Not reached */
+	return NULL;
+}
+
+int log_init(int level)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+
+	log_level = level;
+	setvbuf(stderr, outbuf, _IOFBF, sizeof(outbuf));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, &log_routine, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		setvbuf(stderr, NULL, _IONBF, 0);
+		return 0;
+	}
+	__atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void log_write(int level,
+	       const char *file,
+	       int line,
+	       const char *fmt, ...)
+{
+	struct log_record sync, *r = &sync;
+	unsigned long head = 0;
+	va_list ap;
+
+	if (__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+		if (!own)
+			own = log_ring();
+	}
+	if (own) {
+		head = own->head;
+		if (head - __atomic_load_n(&own->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+			__atomic_store_n(&own->dropped, own->dropped + 1, __ATOMIC_RELAXED);
+			return;
+		}
+		r = &own->rec[head & (LOG_RING_SIZE - 1)];
+	}
+
+	clock_gettime(CLOCK_REALTIME, &r->ts);
+	r->fmt = fmt;
+	r->file = file;
+	r->line = line;
+	r->level = level;
+	r->len = 0;
+	va_start(ap, fmt);
+	log_pack(r, ap);
+	va_end(ap);
+
+	if (!own) {
+		log_emit(r);
+		fflush(stderr);
+		return;
+	}
+	__atomic_store_n(&own->head, head + 1, __ATOMIC_RELEASE);
+
+	if (level > DEBUG_ERROR)
+		return;
+	while (__atomic_load_n(&own->tail, __ATOMIC_ACQUIRE) != head + 1)
+		msleep(1);
+}
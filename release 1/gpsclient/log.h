@@ -0,0 +1,17 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+/* Records per thread ring, power of two */
+#define LOG_RING_SIZE 256
+
+/* Records above this level are filtered by debug() before any work */
+extern int log_level;
+
+int log_init(int level);
+
+void log_write(int level,
+	       const char *file,
+	       int line,
+	       const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+#endif /* _LOG_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Header and checksum validation of received messages, a batch at a
+ * time and where they were received. The checksum covers everything
+ * after the crc field with the timestamp in host order, so only the
+ * header words are byteswapped, into a small array, and the payload is
+ * checksummed in place with several messages interleaved.
+ */
+#include <arpa/inet.h>
+#include "crc16.h"
+#include "msgcheck.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define MSGCHECK_SSSE3
+#endif
+
+/* Messages validated per round, bounds the stack */
+#define MSGCHECK_CHUNK 32
+
+/* The header words of a tgr_msg in host order */
+struct msg_head {
+	uint16_t hdr;
+	uint16_t crc;
+	uint32_t tsp;
+};
+
+static void swap_heads(const struct tgr_msg *msgs,
+		       struct msg_head *head,
+		       int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		head[i].hdr = ntohs(msgs[i].hdr);
+		head[i].crc = ntohs(msgs[i].crc);
+		head[i].tsp = ntohl(msgs[i].tsp);
+	}
+}
+
+#ifdef MSGCHECK_SSSE3
+/* Two headers per shuffle */
+__attribute__((target("ssse3")))
+static void swap_heads_ssse3(const struct tgr_msg *msgs,
+			     struct msg_head *head,
+			     int n)
+{
+	const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 7, 6, 5, 4,
+					   9, 8, 11, 10, 15, 14, 13, 12);
+	__m128i lo, hi;
+	int i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		lo = _mm_loadl_epi64((const __m128i *) &msgs[i]);
+		hi = _mm_loadl_epi64((const __m128i *) &msgs[i + 1]);
+		_mm_storeu_si128((__m128i *) &head[i],
+				 _mm_shuffle_epi8(_mm_unpacklo_epi64(lo, hi), mask));
+	}
+	swap_heads(&msgs[i], &head[i], n - i);
+}
+#endif
+
+/*
+ * Validate n complete messages, verdicts receives MSG_VALID or why one
+ * was rejected. Returns the number of valid messages.
+ */
+int process_msgs(const struct tgr_msg *msgs,
+		 int n,
+		 uint8_t *verdicts)
+{
+	struct msg_head head[MSGCHECK_CHUNK];
+	unsigned short crc[MSGCHECK_CHUNK];
+	const unsigned char *p[MSGCHECK_CHUNK];
+	int base, i, m, nvalid = 0;
+
+	for (base = 0; base < n; base += m) {
+		m = n - base < MSGCHECK_CHUNK ? n - base : MSGCHECK_CHUNK;
+
+#ifdef MSGCHECK_SSSE3
+		if (__builtin_cpu_supports("ssse3"))
+			swap_heads_ssse3(&msgs[base], head, m);
+		else
+#endif
+			swap_heads(&msgs[base], head, m);
+
+		for (i = 0; i < m; i++) {
+			crc[i] = crc16(0, (char *) &head[i].tsp, sizeof(head[i].tsp));
+			p[i] = (const unsigned char *) msgs[base + i].__reserved;
+		}
+		crc16_many(crc, p, sizeof(msgs->__reserved), m);
+
+		for (i = 0; i < m; i++) {
+			if (head[i].hdr != MSG_HDR)
+				verdicts[base + i] = MSG_BAD_HDR;
+			else if (head[i].crc != crc[i])
+				verdicts[base + i] = MSG_BAD_CRC;
+			else {
+				verdicts[base + i] = MSG_VALID;
+				nvalid++;
+			}
+		}
+	}
+	return nvalid;
+}
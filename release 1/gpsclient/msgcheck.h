@@ -0,0 +1,16 @@
+#ifndef _MSGCHECK_H_
+#define _MSGCHECK_H_
+
+#include <stdint.h>
+#include "msg.h"
+
+/* process_msgs() verdicts */
+#define MSG_VALID   0
+#define MSG_BAD_HDR 1
+#define MSG_BAD_CRC 2
+
+int process_msgs(const struct tgr_msg *msgs,
+		 int n,
+		 uint8_t *verdicts);
+
+#endif /* _MSGCHECK_H_ */
@@ -0,0 +1,162 @@
+/*
+ * Compact block encoding of buffered records, used by the SQLite buffer
+ * with buffer-compress enabled.
+ *
+ * A block is the record count followed by the records, each field as a
+ * zig-zag varint of its difference to the previous record:
+ *
+ *	gps_tsp			microseconds
+ *	recv_tsp - gps_tsp	microseconds
+ *	gps_lat, gps_lon	1e-7 degree, about 1 cm
+ *	sender_ip		host order address
+ *	packet_type		one byte, not delta coded
+ *
+ * The first record is coded against zero. A client that stays in place
+ * and hears one sender needs about 10 bytes per record. Differences are
+ * taken modulo 2^64, so any value round trips, NaN included.
+ */
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "recpack.h"
+
+#define RECPACK_NAN ((uint64_t) 1 << 63)
+
+static uint64_t fixed(double x,
+		      double scale)
+{
+	if (!isfinite(x))
+		return RECPACK_NAN;
+	return (uint64_t) llround(x * scale);
+}
+
+static double unfixed(uint64_t v,
+		      double scale)
+{
+	if (v == RECPACK_NAN)
+		return NAN;
+	return (int64_t) v / scale;
+}
+
+static unsigned char *put_varint(unsigned char *p,
+				 uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* Zig-zag folds small negative differences into small codes */
+static unsigned char *put_delta(unsigned char *p,
+				uint64_t v,
+				uint64_t prev)
+{
+	uint64_t d = v - prev;
+
+	return put_varint(p, (d << 1) ^ -(d >> 63));
+}
+
+static const unsigned char *get_varint(const unsigned char *p,
+				       const unsigned char *end,
+				       uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+static const unsigned char *get_delta(const unsigned char *p,
+				      const unsigned char *end,
+				      uint64_t *v)
+{
+	uint64_t z;
+
+	p = get_varint(p, end, &z);
+	if (p)
+		*v += (z >> 1) ^ -(z & 1);
+	return p;
+}
+
+/* Encode count records into out, which must hold RECPACK_MAX(count) bytes */
+int recpack_encode(const struct db_record *rec,
+		   int count,
+		   unsigned char *out)
+{
+	uint64_t ts, off, lat, lon, ip;
+	uint64_t pts = 0, poff = 0, plat = 0, plon = 0, pip = 0;
+	unsigned char *p = out;
+	int i;
+
+	p = put_varint(p, count);
+	for (i = 0; i < count; i++) {
+		ts = fixed(rec[i].gps_tsp, 1e6);
+		off = fixed(rec[i].recv_tsp, 1e6) - ts;
+		lat = fixed(rec[i].gps_lat, 1e7);
+		lon = fixed(rec[i].gps_lon, 1e7);
+		ip = ntohl(rec[i].sender_ip);
+
+		p = put_delta(p, ts, pts);
+		p = put_delta(p, off, poff);
+		p = put_delta(p, lat, plat);
+		p = put_delta(p, lon, plon);
+		p = put_delta(p, ip, pip);
+		*p++ = rec[i].packet_type;
+
+		pts = ts;
+		poff = off;
+		plat = lat;
+		plon = lon;
+		pip = ip;
+	}
+	return p - out;
+}
+
+/*
+ * Decode up to max records of the block in into rec. Returns the number
+ * of records decoded, or -1 if the block is malformed.
+ */
+int recpack_decode(const unsigned char *in,
+		   size_t len,
+		   struct db_record *rec,
+		   int max)
+{
+	const unsigned char *p = in, *end = in + len;
+	uint64_t count, ts = 0, off = 0, lat = 0, lon = 0, ip = 0;
+	int i;
+
+	p = get_varint(p, end, &count);
+	if (!p)
+		return -1;
+	for (i = 0; i < count && i < max; i++) {
+		p = get_delta(p, end, &ts);
+		if (p)
+			p = get_delta(p, end, &off);
+		if (p)
+			p = get_delta(p, end, &lat);
+		if (p)
+			p = get_delta(p, end, &lon);
+		if (p)
+			p = get_delta(p, end, &ip);
+		if (!p || p == end)
+			return -1;
+
+		rec[i].gps_tsp = unfixed(ts, 1e6);
+		rec[i].recv_tsp = unfixed(ts + off, 1e6);
+		rec[i].gps_lat = unfixed(lat, 1e7);
+		rec[i].gps_lon = unfixed(lon, 1e7);
+		rec[i].sender_ip = htonl(ip);
+		rec[i].packet_type = *p++;
+		memset(rec[i].__reserved, 0, sizeof(rec[i].__reserved));
+	}
+	return i;
+}
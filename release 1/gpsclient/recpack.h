@@ -0,0 +1,19 @@
+#ifndef _RECPACK_H_
+#define _RECPACK_H_
+
+#include <stddef.h>
+#include "database.h"
+
+/* Upper bound of the encoded size of count records */
+#define RECPACK_MAX(count) (10 + (count) * 51)
+
+int recpack_encode(const struct db_record *rec,
+		   int count,
+		   unsigned char *out);
+
+int recpack_decode(const unsigned char *in,
+		   size_t len,
+		   struct db_record *rec,
+		   int max);
+
+#endif /* _RECPACK_H_ */
@@ -0,0 +1,345 @@
+/*
+ * Append-only segment log, the "buffer-backend log" alternative to the
+ * SQLite buffer. Records have a fixed size and are appended to memory
+ * mapped segment files <buffer-file>.NNNNNNNN of SEGLOG_RECS records each.
+ * The read cursor lives in <buffer-file>.cursor and is replaced with
+ * rename(), so it is either the old or the new one after a crash.
+ *
+ * Every record carries the complement of its segment number and a crc16
+ * of its payload. The tail is recovered by scanning the last segment for
+ * the first record that fails either check, which also rejects stale
+ * records left in a recycled segment file.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "crc16.h"
+#include "utils.h"
+#include "seglog.h"
+
+/* Records per segment file */
+#define SEGLOG_RECS 4096
+
+/* Drained segment files kept for reuse */
+#define SEGLOG_SPARES 4
+
+#define SEGLOG_TAG(seg) (~(uint32_t) (seg))
+
+struct seglog_rec {
+	uint32_t tag;		/* SEGLOG_TAG of the owning segment */
+	uint16_t crc;		/* crc16 of data */
+	uint16_t __reserved;
+	struct db_record data;
+};
+
+struct seglog_map {
+	uint32_t seg;
+	int fd;
+	struct seglog_rec *recs;
+};
+
+static char prefix[256];
+static uint64_t head, tail;	/* seg * SEGLOG_RECS + index */
+static struct seglog_map tail_map, read_map;
+static uint32_t spare[SEGLOG_SPARES];
+static int nspare;
+static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+
+#define POS_SEG(pos) ((uint32_t) ((pos) / SEGLOG_RECS))
+#define POS_IDX(pos) ((unsigned) ((pos) % SEGLOG_RECS))
+
+static void seg_path(char *path,
+		     size_t size,
+		     uint32_t seg)
+{
+	snprintf(path, size, "%s.%08x", prefix, seg);
+}
+
+static int rec_valid(const struct seglog_rec *rec,
+		     uint32_t seg)
+{
+	return rec->tag == SEGLOG_TAG(seg) &&
+	       rec->crc == crc16(0, (char*) &rec->data, sizeof(rec->data));
+}
+
+static void seg_unmap(struct seglog_map *map)
+{
+	if (!map->recs)
+		return;
+	munmap(map->recs, SEGLOG_RECS * sizeof(struct seglog_rec));
+	close(map->fd);
+	map->recs = NULL;
+}
+
+/*
+ * Map segment seg. With create set a missing segment is made from a spare
+ * file, or allocated when there is none.
+ */
+static int seg_map(struct seglog_map *map,
+		   uint32_t seg,
+		   int create)
+{
+	char path[sizeof(prefix) + 16], old[sizeof(prefix) + 16];
+	size_t size = SEGLOG_RECS * sizeof(struct seglog_rec);
+	void *p;
+	int fd, ret;
+
+	if (map->recs && map->seg == seg)
+		return 1;
+	seg_unmap(map);
+
+	seg_path(path, sizeof(path), seg);
+	if (create && access(path, F_OK) && nspare) {
+		seg_path(old, sizeof(old), spare[--nspare]);
+		if (rename(old, path))
+			debug(DEBUG_WARNING, "could not recycle %s: %s", old, strerror(errno));
+	}
+
+	fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+	if (fd == -1) {
+		debug(DEBUG_ERROR, "could not open %s: %s", path, strerror(errno));
+		return 0;
+	}
+	/* Allocated, not sparse: a full disk fails here, not as SIGBUS later */
+	if (create && (ret = posix_fallocate(fd, 0, size))) {
+		debug(DEBUG_ERROR, "could not allocate %s: %s", path, strerror(ret));
+		close(fd);
+		return 0;
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		debug(DEBUG_ERROR, "could not map %s: %s", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	map->seg = seg;
+	map->fd = fd;
+	map->recs = p;
+	return 1;
+}
+
+/* Keep a drained segment for reuse, or remove it */
+static void seg_release(uint32_t seg)
+{
+	char path[sizeof(prefix) + 16];
+
+	if (nspare < SEGLOG_SPARES) {
+		spare[nspare++] = seg;
+		return;
+	}
+	seg_path(path, sizeof(path), seg);
+	unlink(path);
+}
+
+static int cursor_write(uint64_t pos)
+{
+	char path[sizeof(prefix) + 16], tmp[sizeof(prefix) + 16];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s.cursor", prefix);
+	snprintf(tmp, sizeof(tmp), "%s.cursor~", prefix);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return 0;
+	ret = write(fd, &pos, sizeof(pos)) == sizeof(pos) && !fdatasync(fd);
+	close(fd);
+	if (!ret || rename(tmp, path)) {
+		debug(DEBUG_ERROR, "could not write %s: %s", path, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+static int cursor_read(uint64_t *pos)
+{
+	char path[sizeof(prefix) + 16];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s.cursor", prefix);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	ret = read(fd, pos, sizeof(*pos)) == sizeof(*pos);
+	close(fd);
+	return ret;
+}
+
+/* Lowest and highest segment numbers present on disk */
+static int seg_scan(uint32_t *lo,
+		    uint32_t *hi)
+{
+	char dir[sizeof(prefix)], base[sizeof(prefix)], *end;
+	struct dirent *ent;
+	unsigned long seg;
+	size_t len;
+	DIR *dp;
+	int found = 0;
+
+	snprintf(dir, sizeof(dir), "%s", prefix);
+	snprintf(base, sizeof(base), "%s", prefix);
+	dp = opendir(dirname(dir));
+	if (!dp)
+		return 0;
+	len = strlen(basename(base));
+	while ((ent = readdir(dp))) {
+		if (strncmp(ent->d_name, basename(base), len) || ent->d_name[len] != '.')
+			continue;
+		seg = strtoul(ent->d_name + len + 1, &end, 16);
+		if (*end || end - (ent->d_name + len + 1) != 8)
+			continue;
+		if (!found || seg < *lo)
+			*lo = seg;
+		if (!found || seg > *hi)
+			*hi = seg;
+		found = 1;
+	}
+	closedir(dp);
+	return found;
+}
+
+int seglog_open(const char *path)
+{
+	uint32_t lo = 0, hi = 0, seg;
+	unsigned idx;
+	int found;
+
+	snprintf(prefix, sizeof(prefix), "%s", path);
+	found = seg_scan(&lo, &hi);
+	if (!cursor_read(&head))
+		head = (uint64_t) lo * SEGLOG_RECS;
+
+	/* Segments before the cursor were drained before shutdown */
+	for (seg = lo; found && seg < POS_SEG(head); seg++)
+		seg_release(seg);
+
+	if (!found || hi < POS_SEG(head)) {
+		tail = head;
+		return 1;
+	}
+
+	/* Recover the tail from the last segment */
+	if (!seg_map(&tail_map, hi, 0))
+		return 0;
+	idx = hi == POS_SEG(head) ? POS_IDX(head) : 0;
+	while (idx < SEGLOG_RECS && rec_valid(&tail_map.recs[idx], hi))
+		idx++;
+	tail = (uint64_t) hi * SEGLOG_RECS + idx;
+	debug(DEBUG_INFO, "buffer log recovered backlog=%i", seglog_backlog());
+	return 1;
+}
+
+/*
+ * Append count records and make them durable with one fdatasync(). Returns
+ * the number of records made durable, less than count if a segment could
+ * not be mapped or synced.
+ */
+int seglog_append(const struct db_record *data,
+		  int count)
+{
+	struct seglog_rec *rec;
+	int i, fd, durable = 0, failed = 0;
+
+	pthread_mutex_lock(&loglock);
+	for (i = 0; i < count; i++) {
+		if (!seg_map(&tail_map, POS_SEG(tail), 1))
+			break;
+		rec = &tail_map.recs[POS_IDX(tail)];
+		memcpy(&rec->data, &data[i], sizeof(struct db_record));
+		rec->crc = crc16(0, (char*) &rec->data, sizeof(rec->data));
+		rec->tag = SEGLOG_TAG(POS_SEG(tail));
+		tail++;
+
+		/* Segment full, flush it before moving to the next one */
+		if (!POS_IDX(tail)) {
+			if (fdatasync(tail_map.fd) == -1)
+				failed = errno;
+			else if (!failed)
+				durable = i + 1;
+		}
+	}
+	fd = tail_map.recs ? tail_map.fd : -1;
+	pthread_mutex_unlock(&loglock);
+
+	if (fd != -1 && fdatasync(fd) == -1 && !failed)
+		failed = errno;
+	if (failed)
+		debug(DEBUG_ERROR, "could not sync buffer log: %s", strerror(failed));
+	else
+		durable = i;
+	return durable;
+}
+
+/* Copy up to max records from the head, without consuming them */
+int seglog_read(struct db_record *data,
+		int max)
+{
+	uint64_t pos;
+	int n = 0;
+
+	pthread_mutex_lock(&loglock);
+	for (pos = head; pos < tail && n < max; pos++) {
+		if (!seg_map(&read_map, POS_SEG(pos), 0))
+			break;
+		memcpy(&data[n++], &read_map.recs[POS_IDX(pos)].data, sizeof(struct db_record));
+	}
+	pthread_mutex_unlock(&loglock);
+	return n;
+}
+
+/* Move the durable read cursor past count records */
+int seglog_consume(int count)
+{
+	uint32_t seg;
+	uint64_t pos;
+
+	pthread_mutex_lock(&loglock);
+	pos = head + count;
+	if (pos > tail)
+		pos = tail;
+	pthread_mutex_unlock(&loglock);
+
+	/* Cursor first, a crash may then leak a segment but never replays one */
+	if (!cursor_write(pos))
+		return 0;
+
+	pthread_mutex_lock(&loglock);
+	for (seg = POS_SEG(head); seg < POS_SEG(pos); seg++) {
+		if (read_map.recs && read_map.seg == seg)
+			seg_unmap(&read_map);
+		seg_release(seg);
+	}
+	head = pos;
+	pthread_mutex_unlock(&loglock);
+	return 1;
+}
+
+int seglog_backlog(void)
+{
+	int count;
+
+	pthread_mutex_lock(&loglock);
+	count = tail - head;
+	pthread_mutex_unlock(&loglock);
+	return count;
+}
+
+/* Size of the segment files in use or kept as spares */
+long long seglog_bytes(void)
+{
+	long long segs;
+
+	pthread_mutex_lock(&loglock);
+	segs = POS_SEG(tail) - POS_SEG(head) + 1 + nspare;
+	pthread_mutex_unlock(&loglock);
+	return segs * SEGLOG_RECS * sizeof(struct seglog_rec);
+}
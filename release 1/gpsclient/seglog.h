@@ -0,0 +1,20 @@
+#ifndef _SEGLOG_H_
+#define _SEGLOG_H_
+
+#include "database.h"
+
+int seglog_open(const char *path);
+
+int seglog_append(const struct db_record *data,
+		  int count);
+
+int seglog_read(struct db_record *data,
+		int max);
+
+int seglog_consume(int count);
+
+int seglog_backlog(void);
+
+long long seglog_bytes(void);
+
+#endif /* _SEGLOG_H_ */
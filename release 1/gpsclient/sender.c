@@ -30,6 +30,8 @@ int main(int argc, char **argv)
 		exit(1);
 	}	
 
+	crc16_init();
+
 	ret = inet_pton(AF_INET, argv[1], &addr);
 	if (!ret) {
 		perror("inet_pton");
@@ -4,6 +4,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stdio.h>
+#include "log.h"
 
 enum {
 	DEBUG_FATAL,
@@ -12,21 +13,19 @@ enum {
 	DEBUG_INFO
 };
 
+/*
+ * Least severe level built in, debug() calls past it compile away with
+ * their arguments: -DGPSCLIENT_MIN_LOG_LEVEL=DEBUG_WARNING strips INFO.
+ */
+#ifndef GPSCLIENT_MIN_LOG_LEVEL
+#define GPSCLIENT_MIN_LOG_LEVEL DEBUG_INFO
+#endif
+
+/* Levels disabled at runtime cost a compare, see log.c */
 #define debug(level, ...) \
 do { \
-	const char * const __debug_string[4] = { "FATL", "ERRR", "WARN", "INFO" }; \
-	char __fmt1[2048]; \
-	char __fmt2[2048+128]; \
-	struct timeval __tv; \
-	struct tm __st; \
-	gettimeofday(&__tv, NULL); \
-	localtime_r(&__tv.tv_sec, &__st); \
-	snprintf(__fmt1, sizeof(__fmt1), __VA_ARGS__); \
-	snprintf(__fmt2, sizeof(__fmt2), "[%s] %i%.2i%.2i.%.2i%.2i%.2i.%.2i %s [%s:%i]\n", \
-		 __debug_string[level], (__st.tm_year + 1900) % 100, __st.tm_mon + 1, __st.tm_mday, \
-		 __st.tm_hour, __st.tm_min, __st.tm_sec, (int) __tv.tv_usec / 10000, __fmt1, \
-		 __FILE__, __LINE__); \
-	fprintf(stderr, "%s", __fmt2); \
+	if ((level) <= GPSCLIENT_MIN_LOG_LEVEL && (level) <= log_level) \
+		log_write(level, __FILE__, __LINE__, __VA_ARGS__); \
 } while (0)
 
 void msleep(int ms);